@@ -0,0 +1,95 @@
+/*
+ * Benchmark Helpers
+ *
+ *
+ * Author: agent <agent@local>
+ *
+ * Copyright (C) 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "bench.h"
+
+double bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void bench_check(char *err, const char *what)
+{
+	if(err) {
+		fprintf(stderr, "%s: %s\n", what, err);
+		exit(EXIT_FAILURE);
+	}
+}
+
+unsigned long long bench_du(const char *path, int remove)
+{
+	unsigned long long bytes = 0;
+	struct dirent *ent;
+	struct stat st;
+	DIR *dir;
+
+	if(!(dir = opendir(path)))
+		return 0;
+	while((ent = readdir(dir))) {
+		if(fstatat(dirfd(dir), ent->d_name, &st, 0) || !S_ISREG(st.st_mode))
+			continue;
+		bytes += st.st_blocks * 512ULL;
+		if(remove)
+			unlinkat(dirfd(dir), ent->d_name, 0);
+	}
+	closedir(dir);
+	if(remove)
+		rmdir(path);
+
+	return bytes;
+}
+
+void bench_mesg(struct mesg_rec *r, uint64_t id, uint32_t pgn)
+{
+	uint32_t id32 = id;
+
+	memset(r, 0, sizeof(*r));
+	r->id = id;
+	r->pgn = pgn;
+	r->tv_sec = 1400000000 + id / 1000;
+	r->tv_usec = id % 1000 * 1000;
+	r->iface = id & 1;
+	r->daddr = 0xFF;
+	r->saddr = 0x80 + id % 4;
+	r->dlen = 8;
+	memcpy(r->data, &id32, sizeof(id32));
+}
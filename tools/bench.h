@@ -0,0 +1,59 @@
+/*
+ * Benchmark Helpers
+ *
+ * Timing, disk usage and sample messages shared by the *_bench tools.
+ *
+ *
+ * Author: agent <agent@local>
+ *
+ * Copyright (C) 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#include "mesg_rec.h"
+
+/* Messages stored by the storage benchmarks, unless told otherwise */
+#define BENCH_RECS_DEF	2000000
+/* Messages per commit, like isoblued's default */
+#define BENCH_COMMIT_COUNT	1024
+
+/* Seconds on a monotonic clock */
+double bench_now(void);
+/* Exit with a message if a LevelDB call failed */
+void bench_check(char *err, const char *what);
+/* Bytes of disk used by the files in a directory, optionally removing them */
+unsigned long long bench_du(const char *path, int remove);
+/* Fill in a full, plausible message with the given ID and PGN */
+void bench_mesg(struct mesg_rec *r, uint64_t id, uint32_t pgn);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif /* BENCH_H */
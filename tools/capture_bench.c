@@ -0,0 +1,478 @@
+/*
+ * Capture thread benchmark
+ *
+ * Reads the same messages from 1 to 4 interfaces the way isoblued does by
+ * default, with one thread taking a batch from each interface in turn, and
+ * the way it does with --capture-threads, with a thread per interface
+ * pinned to its own CPU and queueing for the main thread to merge in
+ * timestamp order. Each interface is a Unix sequenced packet socket pair,
+ * which a feeding thread writes CAN frames into as fast as it can; they are
+ * received with recvmmsg and kernel timestamps, as isoblued receives them
+ * from CAN sockets, so the system calls, copies and wakeups are real but no
+ * CAN bus is needed. The feeding threads compete for the CPUs too.
+ *
+ *
+ * Author: agent <agent@local>
+ *
+ * Copyright (C) 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <linux/can.h>
+
+#include "spsc_queue.h"
+#include "bench.h"
+
+/* Messages fed to each interface, unless told otherwise */
+#define RECS_DEF	500000
+#define IFACES_MAX	4
+/* Messages per read, like isoblued's default --recv-batch */
+#define BATCH	32
+/* Same as isoblued's capture queues and merge batches */
+#define CAPTURE_ORDER	12
+#define MERGE_BATCH	1024
+/* Messages in the stand in for isoblued's ring buffer */
+#define OUT_RECS	(1 << 16)
+/* Socket buffer asked for, so feeding does not wait on every batch */
+#define SOCK_BUF	(1 << 20)
+
+/* One interface, with the thread feeding it and the one capturing it */
+struct iface {
+	int iface, cpu;
+	/* Written to by the feeding thread, and read as isoblued reads CAN */
+	int feed_fd, sock;
+	unsigned long nrecs;
+	pthread_t feeder, thread;
+	struct spsc_queue q;
+	/* Everything stamped before this is queued */
+	atomic_ullong watermark;
+};
+
+/* Buffers for one recvmmsg, as isoblued's recv_mesgs uses */
+struct recv_bufs {
+	struct can_frame frames[BATCH];
+	struct iovec iov[BATCH];
+	char cmsgb[BATCH][CMSG_SPACE(sizeof(struct timeval))];
+	struct mmsghdr msgs[BATCH];
+};
+
+static struct mesg_rec out[OUT_RECS];
+
+static inline unsigned long long tv_usecs(unsigned long long sec,
+		unsigned long long usec)
+{
+	return sec * 1000000 + usec;
+}
+
+/* Writes an interface's frames, numbered in their data, as fast as it can */
+static void *feed_func(void *arg)
+{
+	struct iface *ifc = arg;
+	struct can_frame frames[BATCH];
+	struct iovec iov[BATCH];
+	struct mmsghdr msgs[BATCH];
+	unsigned long sent = 0;
+	uint64_t seq;
+	int i, n;
+
+	memset(frames, 0, sizeof(frames));
+	memset(msgs, 0, sizeof(msgs));
+	for(i = 0; i < BATCH; i++) {
+		/* Priority 6, PDU2 PGNs, from a source address per interface */
+		frames[i].can_id = CAN_EFF_FLAG | 6 << 26 | (0xFE00 + i) << 8 |
+			(0x80 + ifc->iface);
+		frames[i].can_dlc = 8;
+		iov[i].iov_base = &frames[i];
+		iov[i].iov_len = sizeof(frames[i]);
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	while(sent < ifc->nrecs) {
+		n = ifc->nrecs - sent < BATCH ? ifc->nrecs - sent : BATCH;
+		for(i = 0; i < n; i++) {
+			seq = sent + i;
+			memcpy(frames[i].data, &seq, sizeof(seq));
+		}
+		if((n = sendmmsg(ifc->feed_fd, msgs, n, 0)) < 0) {
+			perror("sendmmsg");
+			exit(EXIT_FAILURE);
+		}
+		sent += n;
+	}
+
+	return NULL;
+}
+
+/* Receive up to max messages as records, as isoblued's recv_mesgs does */
+static int recv_frames(struct iface *ifc, struct recv_bufs *b,
+		struct mesg_rec *recs, int max)
+{
+	int i, n;
+
+	for(i = 0; i < max; i++) {
+		b->iov[i].iov_base = &b->frames[i];
+		b->iov[i].iov_len = sizeof(b->frames[i]);
+		b->msgs[i].msg_hdr.msg_name = NULL;
+		b->msgs[i].msg_hdr.msg_namelen = 0;
+		b->msgs[i].msg_hdr.msg_iov = &b->iov[i];
+		b->msgs[i].msg_hdr.msg_iovlen = 1;
+		b->msgs[i].msg_hdr.msg_control = b->cmsgb[i];
+		b->msgs[i].msg_hdr.msg_controllen = sizeof(b->cmsgb[i]);
+		b->msgs[i].msg_hdr.msg_flags = 0;
+	}
+
+	if((n = recvmmsg(ifc->sock, b->msgs, max, MSG_DONTWAIT, NULL)) < 0) {
+		if(errno == EAGAIN || errno == EWOULDBLOCK)
+			return 0;
+		perror("recvmmsg");
+		exit(EXIT_FAILURE);
+	}
+
+	for(i = 0; i < n; i++) {
+		canid_t id = b->frames[i].can_id;
+		struct timeval tv = { 0 };
+		struct cmsghdr *cmsg;
+
+		for(cmsg = CMSG_FIRSTHDR(&b->msgs[i].msg_hdr); cmsg != NULL;
+				cmsg = CMSG_NXTHDR(&b->msgs[i].msg_hdr, cmsg)) {
+			if(cmsg->cmsg_level == SOL_SOCKET &&
+					cmsg->cmsg_type == SO_TIMESTAMP)
+				memcpy(&tv, CMSG_DATA(cmsg), sizeof(tv));
+		}
+
+		recs[i].pgn = id >> 8 & 0x3FFFF;
+		recs[i].tv_sec = tv.tv_sec;
+		recs[i].tv_usec = tv.tv_usec;
+		recs[i].iface = ifc->iface;
+		recs[i].daddr = 0xFF;
+		recs[i].saddr = id & 0xFF;
+		recs[i].dlen = b->frames[i].can_dlc;
+		memcpy(recs[i].data, b->frames[i].data, sizeof(recs[i].data));
+	}
+
+	return n;
+}
+
+/* Check each interface's messages come through in the order they were fed */
+static void check_seq(uint64_t *next, const struct mesg_rec *r)
+{
+	uint64_t seq;
+
+	memcpy(&seq, r->data, sizeof(seq));
+	if(seq != next[r->iface]++) {
+		fprintf(stderr, "message %llu from %d out of order\n",
+				(unsigned long long)seq, r->iface);
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* Open a socket pair for each interface and start feeding them */
+static void ifaces_start(struct iface *ifcs, int nifaces, unsigned long nrecs,
+		int ncpus)
+{
+	int i, fds[2], one = 1, size = SOCK_BUF;
+
+	for(i = 0; i < nifaces; i++) {
+		memset(&ifcs[i], 0, sizeof(ifcs[i]));
+		ifcs[i].iface = i;
+		ifcs[i].nrecs = nrecs;
+		/* Leave CPU 0 to the merging thread, if there are enough */
+		ifcs[i].cpu = ncpus > 1 ? 1 + i % (ncpus - 1) : 0;
+		if(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds) < 0) {
+			perror("socketpair");
+			exit(EXIT_FAILURE);
+		}
+		ifcs[i].feed_fd = fds[0];
+		ifcs[i].sock = fds[1];
+		setsockopt(ifcs[i].feed_fd, SOL_SOCKET, SO_SNDBUF, &size,
+				sizeof(size));
+		if(setsockopt(ifcs[i].sock, SOL_SOCKET, SO_TIMESTAMP, &one,
+					sizeof(one)) < 0) {
+			perror("setsockopt");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	for(i = 0; i < nifaces; i++) {
+		if((errno = pthread_create(&ifcs[i].feeder, NULL, feed_func,
+						&ifcs[i]))) {
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+static void ifaces_stop(struct iface *ifcs, int nifaces)
+{
+	int i;
+
+	for(i = 0; i < nifaces; i++) {
+		pthread_join(ifcs[i].feeder, NULL);
+		close(ifcs[i].feed_fd);
+		close(ifcs[i].sock);
+	}
+}
+
+/* One thread taking a batch from each interface with messages in turn */
+static double bench_single(int nifaces, unsigned long nrecs, int ncpus)
+{
+	struct iface ifcs[IFACES_MAX];
+	struct pollfd pfds[IFACES_MAX];
+	struct recv_bufs b;
+	uint64_t next[IFACES_MAX] = { 0 }, id = 1, tail = 0;
+	unsigned long left = nifaces * nrecs;
+	double start;
+	int i, j, n;
+
+	start = bench_now();
+	ifaces_start(ifcs, nifaces, nrecs, ncpus);
+	while(left) {
+		for(i = 0; i < nifaces; i++) {
+			pfds[i].fd = ifcs[i].sock;
+			pfds[i].events = POLLIN;
+		}
+		if(poll(pfds, nifaces, -1) < 0 && errno != EINTR) {
+			perror("poll");
+			exit(EXIT_FAILURE);
+		}
+
+		for(i = 0; i < nifaces; i++) {
+			if(!(pfds[i].revents & POLLIN)) {
+				continue;
+			}
+			if(tail + BATCH > OUT_RECS) {
+				tail = 0;
+			}
+			n = recv_frames(&ifcs[i], &b, &out[tail], BATCH);
+			for(j = 0; j < n; j++) {
+				check_seq(next, &out[tail]);
+				out[tail++].id = id++;
+				left--;
+			}
+		}
+	}
+	ifaces_stop(ifcs, nifaces);
+
+	return bench_now() - start;
+}
+
+static void *capture_func(void *arg)
+{
+	struct iface *ifc = arg;
+	struct pollfd pfd = { .fd = ifc->sock, .events = POLLIN };
+	struct mesg_rec recs[BATCH];
+	struct recv_bufs b;
+	struct timeval tv;
+	unsigned long got = 0, room;
+	int n, max;
+
+	while(got < ifc->nrecs) {
+		room = spsc_queue_free_elems(&ifc->q);
+		max = room < BATCH ? (int)room : BATCH;
+		if(!max) {
+			sched_yield();
+			continue;
+		}
+
+		/* Anything not yet read arrived after the socket was found empty */
+		gettimeofday(&tv, NULL);
+		if((n = recv_frames(ifc, &b, recs, max))) {
+			spsc_queue_push(&ifc->q, recs, n);
+			got += n;
+		}
+		if(n < max) {
+			atomic_store(&ifc->watermark, tv_usecs(tv.tv_sec, tv.tv_usec));
+			if(got < ifc->nrecs && poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+				perror("poll");
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+	atomic_store(&ifc->watermark, ULLONG_MAX);
+
+	return NULL;
+}
+
+/*
+ * A thread per interface, merged in timestamp order as isoblued does
+ *
+ * Counts how often the merge held a message back, and how often one came in
+ * stamped before one already merged.
+ */
+static double bench_threads(int nifaces, unsigned long nrecs, int ncpus,
+		unsigned long *held, unsigned long *late)
+{
+	struct iface ifcs[IFACES_MAX];
+	struct mesg_rec *heads[IFACES_MAX];
+	unsigned long counts[IFACES_MAX], taken[IFACES_MAX];
+	unsigned long long marks[IFACES_MAX], ts = 0, last = 0;
+	unsigned long left = nifaces * nrecs;
+	uint64_t next[IFACES_MAX] = { 0 }, id = 1, tail = 0;
+	pthread_attr_t attr;
+	cpu_set_t set;
+	double start;
+	int i, j, nxt, n;
+
+	*held = *late = 0;
+	start = bench_now();
+	ifaces_start(ifcs, nifaces, nrecs, ncpus);
+	for(i = 0; i < nifaces; i++) {
+		if(spsc_queue_create(&ifcs[i].q, CAPTURE_ORDER,
+					sizeof(struct mesg_rec)) < 0) {
+			perror("spsc_queue_create");
+			exit(EXIT_FAILURE);
+		}
+		pthread_attr_init(&attr);
+		CPU_ZERO(&set);
+		CPU_SET(ifcs[i].cpu, &set);
+		pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+		if((errno = pthread_create(&ifcs[i].thread, &attr, capture_func,
+						&ifcs[i]))) {
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+		pthread_attr_destroy(&attr);
+	}
+
+	while(left) {
+		for(i = 0; i < nifaces; i++) {
+			marks[i] = atomic_load(&ifcs[i].watermark);
+			counts[i] = spsc_queue_peek(&ifcs[i].q, (void **)&heads[i]);
+			taken[i] = 0;
+		}
+
+		for(n = 0; n < MERGE_BATCH; n++) {
+			nxt = -1;
+			for(i = 0; i < nifaces; i++) {
+				if(counts[i] && (nxt < 0 || tv_usecs(heads[i]->tv_sec,
+								heads[i]->tv_usec) < ts)) {
+					nxt = i;
+					ts = tv_usecs(heads[i]->tv_sec, heads[i]->tv_usec);
+				}
+			}
+			if(nxt < 0) {
+				break;
+			}
+
+			/* Wait while an interface could still have an older one */
+			for(j = 0; j < nifaces; j++) {
+				if(!counts[j] && ts > marks[j]) {
+					break;
+				}
+			}
+			if(j < nifaces) {
+				(*held)++;
+				break;
+			}
+
+			if(ts < last) {
+				(*late)++;
+			} else {
+				last = ts;
+			}
+			if(tail == OUT_RECS) {
+				tail = 0;
+			}
+			out[tail] = *heads[nxt];
+			check_seq(next, &out[tail]);
+			out[tail++].id = id++;
+			heads[nxt]++;
+			taken[nxt]++;
+			left--;
+
+			if(!--counts[nxt]) {
+				spsc_queue_pop(&ifcs[nxt].q, taken[nxt]);
+				taken[nxt] = 0;
+				marks[nxt] = atomic_load(&ifcs[nxt].watermark);
+				counts[nxt] = spsc_queue_peek(&ifcs[nxt].q,
+						(void **)&heads[nxt]);
+			}
+		}
+
+		for(i = 0; i < nifaces; i++) {
+			spsc_queue_pop(&ifcs[i].q, taken[i]);
+		}
+		if(!n) {
+			sched_yield();
+		}
+	}
+
+	for(i = 0; i < nifaces; i++) {
+		pthread_join(ifcs[i].thread, NULL);
+		spsc_queue_free(&ifcs[i].q);
+	}
+	ifaces_stop(ifcs, nifaces);
+
+	return bench_now() - start;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long nrecs, held, late;
+	double t_single, t_threads;
+	cpu_set_t set;
+	int ncpus, i;
+
+	if(argc > 2) {
+		fprintf(stderr, "usage: capture_bench [RECORDS]\n");
+		return EXIT_FAILURE;
+	}
+	nrecs = argc > 1 ? strtoul(argv[1], NULL, 0) : RECS_DEF;
+	if(nrecs < 1) {
+		fprintf(stderr, "RECORDS must be positive\n");
+		return EXIT_FAILURE;
+	}
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	/* Reading and merging both happen on CPU 0 */
+	CPU_ZERO(&set);
+	CPU_SET(0, &set);
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+
+	printf("feeding %lu messages per interface, %d CPUs\n", nrecs, ncpus);
+	for(i = 1; i <= IFACES_MAX; i++) {
+		t_single = bench_single(i, nrecs, ncpus);
+		t_threads = bench_threads(i, nrecs, ncpus, &held, &late);
+		printf("%d interfaces: one thread %9.0f messages/s, "
+				"capture threads %9.0f messages/s (%4.2fx), "
+				"merge held back %lu times, %lu stamped late\n",
+				i, i * nrecs / t_single, i * nrecs / t_threads,
+				t_single / t_threads, held, late);
+	}
+
+	return EXIT_SUCCESS;
+}
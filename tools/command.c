@@ -0,0 +1,216 @@
+/*
+ * Command Parsing Library
+ *
+ *
+ * Author: agent <agent@local>
+ *
+ * Copyright (C) 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "hex.h"
+#include "command.h"
+
+int command_buf_create(struct command_buf *cb, size_t size)
+{
+	if(!(cb->buf = malloc(size)))
+		return -1;
+	cb->size = size;
+	cb->dropped = 0;
+	command_buf_clear(cb);
+
+	return 0;
+}
+
+void command_buf_free(struct command_buf *cb)
+{
+	free(cb->buf);
+	cb->buf = NULL;
+}
+
+void command_buf_clear(struct command_buf *cb)
+{
+	cb->head = cb->curs = cb->tail = 0;
+	cb->skip = false;
+}
+
+/*
+ * Finds room to receive more into, returning how much there is
+ *
+ * Once everything received has been handed out the buffer starts over at the
+ * front. Otherwise the unfinished command is only moved there when the buffer
+ * is full, so each byte is moved at most once per buffer's worth received.
+ */
+size_t command_buf_space(struct command_buf *cb, char **space)
+{
+	if(cb->head == cb->tail) {
+		cb->head = cb->curs = cb->tail = 0;
+	} else if(cb->tail == cb->size) {
+		if(cb->head) {
+			memmove(cb->buf, cb->buf + cb->head, cb->tail - cb->head);
+			cb->curs -= cb->head;
+			cb->tail -= cb->head;
+			cb->head = 0;
+		} else {
+			/* One command fills the buffer, so it can never be ended */
+			cb->dropped++;
+			cb->head = cb->curs = cb->tail = 0;
+			cb->skip = true;
+		}
+	}
+
+	*space = cb->buf + cb->tail;
+	return cb->size - cb->tail;
+}
+
+/*
+ * Hands out the next whole command received, or NULL if there is none
+ *
+ * The command is ended with a '\0' in place of its '\n' or '\r', and stays
+ * valid until command_buf_space is next called. Empty commands are skipped.
+ */
+char *command_buf_next(struct command_buf *cb, size_t *len)
+{
+	char *cmd, *from, *end, *cr;
+
+	while(cb->curs < cb->tail) {
+		cmd = cb->buf + cb->head;
+		from = cb->buf + cb->curs;
+		end = memchr(from, '\n', cb->tail - cb->curs);
+		cr = memchr(from, '\r', end ? (size_t)(end - from) :
+				cb->tail - cb->curs);
+		if(cr)
+			end = cr;
+
+		if(!end) {
+			cb->curs = cb->tail;
+			return NULL;
+		}
+
+		*end = '\0';
+		*len = end - cmd;
+		cb->head = cb->curs = end - cb->buf + 1;
+
+		if(cb->skip) {
+			cb->skip = false;
+			continue;
+		}
+		if(*len)
+			return cmd;
+	}
+
+	return NULL;
+}
+
+/*
+ * Puts back the command command_buf_next last handed out, to be handed out
+ * again later, as when it can not be handled yet
+ */
+void command_buf_unget(struct command_buf *cb, char *cmd, size_t len)
+{
+	cmd[len] = '\n';
+	cb->head = cb->curs = cmd - cb->buf;
+}
+
+/* Parses the two 32-bit values starting past and time range commands */
+int command_parse_range(const char *args, size_t len, uint32_t *first,
+		uint32_t *last)
+{
+	if(len < 16 || hex_get(args, 8, first) < 0 ||
+			hex_get(args + 8, 8, last) < 0)
+		return -1;
+
+	return 0;
+}
+
+/* Parses a send command, <pgn:5x><daddr:2x><dlen:4x><data:2x>... */
+int command_parse_send(const char *args, size_t len,
+		struct command_send *send)
+{
+	uint32_t pgn, daddr, dlen;
+
+	if(len < 11 || hex_get(args, 5, &pgn) < 0 ||
+			hex_get(args + 5, 2, &daddr) < 0 ||
+			hex_get(args + 7, 4, &dlen) < 0)
+		return -1;
+	if(dlen > sizeof(send->data) || len < 11 + 2 * dlen ||
+			hex_get_bytes(args + 11, send->data, dlen) < 0)
+		return -1;
+
+	send->pgn = pgn;
+	send->daddr = daddr;
+	send->dlen = dlen;
+
+	return 0;
+}
+
+/*
+ * Parses a filter, as set for the live stream or ending a past data command
+ *
+ * The PGNs, source addresses and destination addresses wanted are each
+ * given as a count followed by that many values:
+ * <count:5x><pgn:5x>... <count:2x><saddr:2x>... <count:2x><daddr:2x>...
+ * Leaving out a field, or giving a count of 0, accepts any value for it.
+ *
+ * The PGNs listed are also put in pgns, if there are no more than max of
+ * them. Returns how many were, or -1 if the filter is invalid.
+ */
+int command_parse_filter(const char *args, size_t len,
+		struct mesg_filter *filt, uint32_t *pgns, int max)
+{
+	static const int nibs[] = { 5, 2, 2 };
+	uint32_t n, val, i, field;
+	int npgns = 0;
+
+	mesg_filter_clear(filt);
+	for(field = 0; field < 3 && len; field++) {
+		if(len < (size_t)nibs[field] || hex_get(args, nibs[field], &n) < 0)
+			return -1;
+		args += nibs[field];
+		len -= nibs[field];
+
+		for(i = 0; i < n; i++) {
+			if(len < (size_t)nibs[field] ||
+					hex_get(args, nibs[field], &val) < 0)
+				return -1;
+			args += nibs[field];
+			len -= nibs[field];
+
+			switch(field) {
+			case 0:
+				mesg_filter_add_pgn(filt, val);
+				if(n <= (uint32_t)max)
+					pgns[npgns++] = val;
+				break;
+			case 1:
+				mesg_filter_add_saddr(filt, val);
+				break;
+			case 2:
+				mesg_filter_add_daddr(filt, val);
+				break;
+			}
+		}
+	}
+
+	return npgns;
+}
@@ -0,0 +1,93 @@
+/*
+ * Command Parsing Library
+ *
+ * Reassembles the newline terminated commands clients send, handing each one
+ * out in place in the receive buffer, and decodes their hex fields. Nothing
+ * is allocated or copied per command; the unfinished end of the buffer is
+ * only moved to the front once the buffer fills.
+ *
+ *
+ * Author: agent <agent@local>
+ *
+ * Copyright (C) 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef COMMAND_H
+#define COMMAND_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "mesg_filter.h"
+
+struct command_buf
+{
+	char *buf;
+	size_t size;
+	/* Start of the next command, and how far its end has been looked for */
+	size_t head, curs;
+	/* End of what has been received */
+	size_t tail;
+	/* Throwing away the rest of a command too long for the buffer */
+	bool skip;
+	unsigned long dropped;
+};
+
+/* A message to send, from a send command */
+struct command_send
+{
+	uint32_t pgn;
+	uint8_t daddr;
+	uint8_t dlen;
+	uint8_t data[8];
+};
+
+int command_buf_create(struct command_buf *cb, size_t size);
+void command_buf_free(struct command_buf *cb);
+void command_buf_clear(struct command_buf *cb);
+
+size_t command_buf_space(struct command_buf *cb, char **space);
+char *command_buf_next(struct command_buf *cb, size_t *len);
+void command_buf_unget(struct command_buf *cb, char *cmd, size_t len);
+
+int command_parse_range(const char *args, size_t len, uint32_t *first,
+		uint32_t *last);
+int command_parse_send(const char *args, size_t len,
+		struct command_send *send);
+int command_parse_filter(const char *args, size_t len,
+		struct mesg_filter *filt, uint32_t *pgns, int max);
+
+/* Function to note len more bytes were received into the space given */
+static inline void command_buf_fill(struct command_buf *cb, size_t len)
+{
+	cb->tail += len;
+}
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif /* COMMAND_H */
@@ -0,0 +1,305 @@
+/*
+ * Command parser benchmark
+ *
+ * Feeds a burst of client commands through the parser isoblued used before
+ * the command library (byte scanning, sscanf, an allocation per command and
+ * moving the whole buffer after each one) and through the command library,
+ * checking they decode the same values. Filters go through the parser the
+ * daemon uses for SET_FILTERS, building the same filter it matches against.
+ *
+ *
+ * Author: agent <agent@local>
+ *
+ * Copyright (C) 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "hex.h"
+#include "command.h"
+#include "mesg_filter.h"
+#include "bench.h"
+
+/* Same as isoblued */
+#define CMD_BUF_SIZE	0x03FFFF
+#define FILTERS_MAX	512
+
+#define CMDS_DEF	200000
+#define CHUNK_DEF	65536
+
+/* Mostly sends, with some past data and filter commands mixed in */
+static size_t make_cmds(char *cp, int ncmds)
+{
+	char *start = cp;
+	int i, j;
+
+	srand(1);
+	for(i = 0; i < ncmds; i++) {
+		switch(i % 5) {
+		case 0:
+			*(cp++) = 'P';
+			*(cp++) = '0';
+			cp = hex_val(cp, rand(), 8);
+			cp = hex_val(cp, rand(), 8);
+			break;
+		case 1:
+			*(cp++) = 'F';
+			*(cp++) = '1';
+			cp = hex_val(cp, 4, 5);
+			for(j = 0; j < 4; j++)
+				cp = hex_val(cp, 0xFE00 + rand() % 256, 5);
+			break;
+		default:
+			*(cp++) = 'W';
+			*(cp++) = '0';
+			cp = hex_val(cp, rand() & 0x3FFFF, 5);
+			cp = hex_byte(cp, rand());
+			cp = hex_val(cp, 8, 4);
+			for(j = 0; j < 8; j++)
+				cp = hex_byte(cp, rand());
+			break;
+		}
+		*(cp++) = '\n';
+	}
+
+	return cp - start;
+}
+
+/* The parser isoblued used before the command library */
+static unsigned long long old_parse(const char *in, size_t inlen, size_t chunk)
+{
+	char *buffer = malloc(CMD_BUF_SIZE);
+	int cmd_curs = 0, cmd_tail = 0;
+	unsigned long long sum = 0;
+	size_t off = 0;
+
+	while(off < inlen) {
+		size_t chars = inlen - off;
+
+		if(chars > chunk)
+			chars = chunk;
+		if(chars > (size_t)(CMD_BUF_SIZE - cmd_tail))
+			chars = CMD_BUF_SIZE - cmd_tail;
+		memcpy(buffer + cmd_tail, in + off, chars);
+		off += chars;
+		cmd_tail += chars;
+
+		while(1) {
+			int done = 0;
+
+			while(cmd_curs < cmd_tail) {
+				if(buffer[cmd_curs] == '\n' || buffer[cmd_curs] == '\r') {
+					done = 1;
+					buffer[cmd_curs++] = '\0';
+					break;
+				}
+				cmd_curs++;
+			}
+			if(!done)
+				break;
+
+			char *args = buffer + 2;
+			switch(buffer[0]) {
+			case 'P':
+			{
+				unsigned int start, stop;
+
+				if(strlen(args) >= 16 &&
+						sscanf(args, "%8x%8x", &start, &stop) == 2)
+					sum += start + stop;
+				break;
+			}
+			case 'F':
+			{
+				int nfilts, i;
+				uint32_t *filts;
+				char *p;
+
+				if(sscanf(args, "%5x", &nfilts) < 1)
+					break;
+				p = args + 5;
+				filts = calloc(nfilts, sizeof(*filts));
+				for(i = 0; i < nfilts; i++) {
+					unsigned int pgn;
+
+					if(sscanf(p, "%5x", &pgn) < 1)
+						break;
+					p += 5;
+					filts[i] = pgn;
+					sum += pgn;
+				}
+				free(filts);
+				break;
+			}
+			case 'W':
+			{
+				int nchars, i;
+				unsigned int pgn, dest, len;
+				unsigned char *data;
+				char *p;
+
+				sscanf(args, "%5x%2x%4x%n", &pgn, &dest, &len, &nchars);
+				p = args + nchars;
+				data = calloc(len, sizeof(*data));
+				for(i = 0; i < (int)len; i++) {
+					sscanf(p, "%2hhx%n", &data[i], &nchars);
+					p += nchars;
+				}
+				sum += pgn + dest + len;
+				for(i = 0; i < (int)len; i++)
+					sum += data[i];
+				free(data);
+				break;
+			}
+			}
+
+			memmove(buffer, buffer + cmd_curs, cmd_tail - cmd_curs);
+			cmd_tail -= cmd_curs;
+			cmd_curs = 0;
+		}
+	}
+	free(buffer);
+
+	return sum;
+}
+
+/* The command library, as isoblued uses it now */
+static unsigned long long new_parse(const char *in, size_t inlen,
+		size_t chunk)
+{
+	static struct mesg_filter filt;
+	struct command_buf cb;
+	uint32_t pgns[FILTERS_MAX];
+	unsigned long long sum = 0;
+	size_t off = 0, len;
+	char *space, *cmd;
+
+	if(command_buf_create(&cb, CMD_BUF_SIZE) < 0) {
+		perror("command_buf_create");
+		exit(EXIT_FAILURE);
+	}
+
+	while(off < inlen) {
+		size_t chars = command_buf_space(&cb, &space);
+
+		if(chars > chunk)
+			chars = chunk;
+		if(chars > inlen - off)
+			chars = inlen - off;
+		memcpy(space, in + off, chars);
+		off += chars;
+		command_buf_fill(&cb, chars);
+
+		while((cmd = command_buf_next(&cb, &len))) {
+			const char *args = cmd + 2;
+			size_t alen = len - 2;
+
+			switch(cmd[0]) {
+			case 'P':
+			{
+				uint32_t start, stop;
+
+				if(command_parse_range(args, alen, &start, &stop) == 0)
+					sum += start + stop;
+				break;
+			}
+			case 'F':
+			{
+				int nfilts, i;
+
+				nfilts = command_parse_filter(args, alen, &filt, pgns,
+						FILTERS_MAX);
+				for(i = 0; i < nfilts; i++)
+					sum += pgns[i];
+				break;
+			}
+			case 'W':
+			{
+				struct command_send send;
+				int i;
+
+				if(command_parse_send(args, alen, &send) < 0)
+					break;
+				sum += send.pgn + send.daddr + send.dlen;
+				for(i = 0; i < send.dlen; i++)
+					sum += send.data[i];
+				break;
+			}
+			}
+		}
+	}
+	command_buf_free(&cb);
+
+	return sum;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long long sum_old, sum_new;
+	double start, t_old, t_new;
+	int ncmds;
+	size_t chunk, len;
+	char *in;
+
+	if(argc > 3) {
+		fprintf(stderr, "usage: command_bench [COMMANDS [CHUNK]]\n");
+		return EXIT_FAILURE;
+	}
+	ncmds = argc > 1 ? atoi(argv[1]) : CMDS_DEF;
+	chunk = argc > 2 ? strtoul(argv[2], NULL, 0) : CHUNK_DEF;
+	if(ncmds < 1 || chunk < 1) {
+		fprintf(stderr, "COMMANDS and CHUNK must be positive\n");
+		return EXIT_FAILURE;
+	}
+
+	/* Longest command is a send, of 30 bytes */
+	if(!(in = malloc((size_t)ncmds * 32))) {
+		perror("malloc");
+		return EXIT_FAILURE;
+	}
+	len = make_cmds(in, ncmds);
+
+	start = bench_now();
+	sum_old = old_parse(in, len, chunk);
+	t_old = bench_now() - start;
+
+	start = bench_now();
+	sum_new = new_parse(in, len, chunk);
+	t_new = bench_now() - start;
+
+	printf("%d commands, %.1f bytes/command, received %zu bytes at a time\n",
+			ncmds, (double)len / ncmds, chunk);
+	printf("old:     %10.0f commands/s\n", ncmds / t_old);
+	printf("command: %10.0f commands/s (%.1fx)\n", ncmds / t_new,
+			t_old / t_new);
+
+	free(in);
+
+	if(sum_old != sum_new) {
+		fprintf(stderr, "parsers disagree\n");
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
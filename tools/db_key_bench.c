@@ -0,0 +1,215 @@
+/*
+ * Message key benchmark
+ *
+ * Stores the same messages in LevelDB under the keys isoblued used to use
+ * (native 32-bit IDs, ordered by its own comparator) and under the keys it
+ * uses now (64-bit IDs big-endian, in LevelDB's own byte order), then
+ * compares how fast each takes them in, scans them in order and looks them up
+ * one by one, and how much disk each uses per message.
+ *
+ *
+ * Author: agent <agent@local>
+ *
+ * Copyright (C) 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <leveldb/c.h>
+
+#include "pgn_index.h"
+#include "bench.h"
+
+#define DB_PATH	"db_key_bench_db"
+
+/* Messages looked up one by one, at random */
+#define GETS	100000
+
+/* How messages are keyed */
+struct key_fmt {
+	const char *name;
+	/* Comparator, or NULL for LevelDB's own */
+	int (*compare)(const char *a, size_t alen, const char *b, size_t blen);
+	size_t len;
+	void (*put)(char *key, uint64_t id);
+	uint64_t (*get)(const char *key);
+};
+
+static void v1_put(char *key, uint64_t id)
+{
+	uint32_t id32 = id;
+
+	memcpy(key, &id32, sizeof(id32));
+}
+static uint64_t v1_get(const char *key)
+{
+	uint32_t id32;
+
+	memcpy(&id32, key, sizeof(id32));
+	return id32;
+}
+
+static const struct key_fmt fmts[] = {
+	{ "native32", pgn_index_compare_v1, sizeof(uint32_t), v1_put, v1_get },
+	{ "be64", NULL, PGN_INDEX_ID_LEN, pgn_index_put_id, pgn_index_get_id },
+};
+
+static int bench_cmp_compare(void *arg, const char *a, size_t alen,
+		const char *b, size_t blen)
+{
+	return ((const struct key_fmt *)arg)->compare(a, alen, b, blen);
+}
+static const char *bench_cmp_name(void *arg __attribute__ ((unused)))
+{
+	return "isoblued.v1";
+}
+static void bench_cmp_destroy(void *arg __attribute__ ((unused))) { }
+
+static void bench(const struct key_fmt *fmt, uint32_t nrecs)
+{
+	leveldb_t *db;
+	leveldb_options_t *options;
+	leveldb_comparator_t *cmp = NULL;
+	leveldb_writeoptions_t *woptions;
+	leveldb_readoptions_t *roptions;
+	leveldb_writebatch_t *wb;
+	leveldb_iterator_t *iter;
+	unsigned long long n = 0, found = 0;
+	char key[PGN_INDEX_ID_LEN], val[HEX_MESG_MAX];
+	struct mesg_rec r;
+	char *err = NULL;
+	double start, t_in, t_scan, t_get;
+	uint64_t last = 0;
+	uint32_t id;
+	size_t len;
+	int i;
+
+	options = leveldb_options_create();
+	if(fmt->compare) {
+		cmp = leveldb_comparator_create((void *)fmt, bench_cmp_destroy,
+				bench_cmp_compare, bench_cmp_name);
+		leveldb_options_set_comparator(options, cmp);
+	}
+	leveldb_options_set_create_if_missing(options, 1);
+	leveldb_destroy_db(options, DB_PATH, &err);
+	bench_check(err, "leveldb_destroy_db");
+	db = leveldb_open(options, DB_PATH, &err);
+	bench_check(err, "leveldb_open");
+	woptions = leveldb_writeoptions_create();
+	roptions = leveldb_readoptions_create();
+	leveldb_readoptions_set_fill_cache(roptions, 0);
+	wb = leveldb_writebatch_create();
+
+	/* Group commits, each with the next ID under ID 0, as isoblued does */
+	start = bench_now();
+	for(id = 1; id <= nrecs; id++) {
+		/* Stored hex, as streamed, but without the opcode */
+		bench_mesg(&r, id, 0xFE00 + id % 64);
+		len = hex_mesg(val, 'M', &r) - val;
+		fmt->put(key, id);
+		leveldb_writebatch_put(wb, key, fmt->len, val + 1, len - 1);
+		if(id % BENCH_COMMIT_COUNT == 0 || id == nrecs) {
+			fmt->put(key, 0);
+			fmt->put(val, id + 1);
+			leveldb_writebatch_put(wb, key, fmt->len, val, fmt->len);
+			leveldb_write(db, woptions, wb, &err);
+			bench_check(err, "leveldb_write");
+			leveldb_writebatch_clear(wb);
+		}
+	}
+	t_in = bench_now() - start;
+
+	/* Replay everything in ID order */
+	start = bench_now();
+	iter = leveldb_create_iterator(db, roptions);
+	fmt->put(key, 1);
+	for(leveldb_iter_seek(iter, key, fmt->len); leveldb_iter_valid(iter);
+			leveldb_iter_next(iter)) {
+		const char *k = leveldb_iter_key(iter, &len);
+
+		if(len != fmt->len || fmt->get(k) <= last)
+			break;
+		last = fmt->get(k);
+		leveldb_iter_value(iter, &len);
+		n++;
+	}
+	t_scan = bench_now() - start;
+
+	/* Seek to single messages, as replays through the PGN index do */
+	srand(1);
+	start = bench_now();
+	for(i = 0; i < GETS; i++) {
+		uint64_t want = 1 + rand() % nrecs;
+
+		fmt->put(key, want);
+		leveldb_iter_seek(iter, key, fmt->len);
+		if(leveldb_iter_valid(iter) &&
+				fmt->get(leveldb_iter_key(iter, &len)) == want)
+			found++;
+	}
+	t_get = bench_now() - start;
+	leveldb_iter_destroy(iter);
+
+	leveldb_close(db);
+	printf("%-8s ingest %9.0f messages/s, scan %9.0f messages/s, "
+			"seek %8.0f messages/s, %5.1f bytes/message on disk\n",
+			fmt->name, nrecs / t_in, n / t_scan, GETS / t_get,
+			(double)bench_du(DB_PATH, 0) / nrecs);
+	leveldb_destroy_db(options, DB_PATH, &err);
+
+	leveldb_writebatch_destroy(wb);
+	leveldb_readoptions_destroy(roptions);
+	leveldb_writeoptions_destroy(woptions);
+	leveldb_options_destroy(options);
+	if(cmp)
+		leveldb_comparator_destroy(cmp);
+
+	if(n != nrecs || found != GETS) {
+		fprintf(stderr, "%s scanned %llu of %u messages, found %llu of %u\n",
+				fmt->name, n, nrecs, found, GETS);
+		exit(EXIT_FAILURE);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	uint32_t nrecs;
+	size_t i;
+
+	if(argc > 2) {
+		fprintf(stderr, "usage: db_key_bench [RECORDS]\n");
+		return EXIT_FAILURE;
+	}
+	nrecs = argc > 1 ? strtoul(argv[1], NULL, 0) : BENCH_RECS_DEF;
+	if(nrecs < 1) {
+		fprintf(stderr, "RECORDS must be positive\n");
+		return EXIT_FAILURE;
+	}
+
+	printf("storing %u messages\n", nrecs);
+	for(i = 0; i < sizeof(fmts) / sizeof(*fmts); i++)
+		bench(&fmts[i], nrecs);
+
+	return EXIT_SUCCESS;
+}
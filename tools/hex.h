@@ -0,0 +1,163 @@
+/*
+ * Hex Encoding Library
+ *
+ * Lowercase hex printing of the fixed width fields in ISOBlue records.
+ *
+ *
+ * Author: agent <agent@local>
+ *
+ * Copyright (C) 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef HEX_H
+#define HEX_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/* Both hex digits of every byte value */
+extern const char hex_table[256][2];
+/* Value of each character as a hex digit, -1 if it is not one */
+extern const int8_t hex_nib_table[256];
+
+/* Function to print one byte as 2 hex digits */
+static inline char *hex_byte(char *cp, uint8_t val)
+{
+	memcpy(cp, hex_table[val], 2);
+
+	return cp + 2;
+}
+
+/* Function to print the low nibs nibbles of val, most significant first */
+static inline char *hex_val(char *cp, uint32_t val, int nibs)
+{
+	if(nibs & 1) {
+		nibs--;
+		*(cp++) = hex_table[(val >> 4 * nibs) & 0x0F][1];
+	}
+	while(nibs) {
+		nibs -= 2;
+		cp = hex_byte(cp, val >> 4 * nibs);
+	}
+
+	return cp;
+}
+
+/* Function to print a run of bytes as hex */
+static inline char *hex_bytes(char *cp, const uint8_t *data, int len)
+{
+	int i;
+
+	for(i = 0; i < len; i++) {
+		cp = hex_byte(cp, data[i]);
+	}
+
+	return cp;
+}
+
+/*
+ * Function to print 8 bytes as 16 hex digits, with SIMD when available
+ *
+ * Always writes all 16 characters, so shorter payloads can be printed by
+ * advancing past only the ones wanted and overwriting the rest.
+ */
+static inline char *hex_bytes8(char *cp, const uint8_t data[8])
+{
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+	static const uint8_t digits[16] = "0123456789abcdef";
+	const uint8x8x2_t tbl = { { vld1_u8(digits), vld1_u8(digits + 8) } };
+	uint8x8_t v = vld1_u8(data);
+	uint8x8x2_t nibs = vzip_u8(vshr_n_u8(v, 4), vand_u8(v, vdup_n_u8(0x0F)));
+
+	vst1_u8((uint8_t *)cp, vtbl2_u8(tbl, nibs.val[0]));
+	vst1_u8((uint8_t *)cp + 8, vtbl2_u8(tbl, nibs.val[1]));
+#elif defined(__SSE2__)
+	const __m128i mask = _mm_set1_epi8(0x0F);
+	__m128i v = _mm_loadl_epi64((const __m128i *)data);
+	__m128i nibs = _mm_unpacklo_epi8(
+			_mm_and_si128(_mm_srli_epi16(v, 4), mask),
+			_mm_and_si128(v, mask));
+	/* '0' + nib, plus the gap up to 'a' for nibbles above 9 */
+	__m128i letters = _mm_and_si128(_mm_cmpgt_epi8(nibs, _mm_set1_epi8(9)),
+			_mm_set1_epi8('a' - '0' - 10));
+
+	_mm_storeu_si128((__m128i *)cp, _mm_add_epi8(nibs,
+				_mm_add_epi8(letters, _mm_set1_epi8('0'))));
+#else
+	hex_bytes(cp, data, 8);
+#endif
+
+	return cp + 16;
+}
+
+/*
+ * Function to read nibs hex digits into val, most significant first
+ *
+ * Returns 0, or -1 if any of them is not a hex digit.
+ */
+static inline int hex_get(const char *cp, int nibs, uint32_t *val)
+{
+	uint32_t v = 0;
+	int8_t bad = 0;
+
+	while(nibs--) {
+		int8_t nib = hex_nib_table[(uint8_t)*(cp++)];
+
+		bad |= nib;
+		v = v << 4 | (nib & 0x0F);
+	}
+	*val = v;
+
+	return bad < 0 ? -1 : 0;
+}
+
+/* Function to read len bytes of 2 hex digits each, returning -1 if invalid */
+static inline int hex_get_bytes(const char *cp, uint8_t *data, int len)
+{
+	int8_t bad = 0;
+	int i;
+
+	for(i = 0; i < len; i++) {
+		int8_t hi = hex_nib_table[(uint8_t)cp[2 * i]];
+		int8_t lo = hex_nib_table[(uint8_t)cp[2 * i + 1]];
+
+		bad |= hi | lo;
+		data[i] = hi << 4 | (lo & 0x0F);
+	}
+
+	return bad < 0 ? -1 : 0;
+}
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif /* HEX_H */
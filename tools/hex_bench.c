@@ -0,0 +1,170 @@
+/*
+ * Hex encoder benchmark
+ *
+ * Times encoding ISOBlue records in the hex stream format with the original
+ * per-nibble encoder and with isoblued's own (from mesg_rec.h), checking
+ * they agree.
+ *
+ *
+ * Author: agent <agent@local>
+ *
+ * Copyright (C) 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "hex.h"
+#include "mesg_rec.h"
+#include "bench.h"
+
+#define RECS_DEF	4096
+#define ROUNDS_DEF	1000
+
+/* The encoder isoblued used before the hex library */
+static inline char nib2hex(uint_fast8_t nib)
+{
+	nib &= 0x0F;
+
+	return nib >= 10 ? nib - 10 + 'a' : nib + '0';
+}
+
+static char *nib_mesg(char *cp, char op, const struct mesg_rec *r)
+{
+	int j;
+
+	*(cp++) = op;
+	*(cp++) = nib2hex(r->iface);
+	for(j = 28; j >= 0; j -= 4)
+		*(cp++) = nib2hex(r->id >> j);
+	for(j = 16; j >= 0; j -= 4)
+		*(cp++) = nib2hex(r->pgn >> j);
+	*(cp++) = nib2hex(r->daddr >> 4);
+	*(cp++) = nib2hex(r->daddr);
+	for(j = 12; j >= 0; j -= 4)
+		*(cp++) = nib2hex(r->dlen >> j);
+	for(j = 0; j < r->dlen; j++) {
+		*(cp++) = nib2hex(r->data[j] >> 4);
+		*(cp++) = nib2hex(r->data[j]);
+	}
+	for(j = 28; j >= 0; j -= 4)
+		*(cp++) = nib2hex(r->tv_sec >> j);
+	for(j = 16; j >= 0; j -= 4)
+		*(cp++) = nib2hex(r->tv_usec >> j);
+	*(cp++) = nib2hex(r->saddr >> 4);
+	*(cp++) = nib2hex(r->saddr);
+	*(cp++) = '\n';
+
+	return cp;
+}
+
+/* Function to time encoding every record for some rounds, in ns/record */
+static double bench(char *(*enc)(char *, char, const struct mesg_rec *),
+		const struct mesg_rec *recs, int nrecs, int rounds, char *out)
+{
+	double start;
+	int i, j;
+
+	start = bench_now();
+	for(i = 0; i < rounds; i++) {
+		char *cp = out;
+
+		for(j = 0; j < nrecs; j++)
+			cp = enc(cp, 'M', &recs[j]);
+		/* Keep the compiler from skipping the work */
+		__asm__ __volatile__("" : : "r"(out) : "memory");
+	}
+
+	return (bench_now() - start) * 1e9 / ((double)nrecs * rounds);
+}
+
+int main(int argc, char *argv[])
+{
+	struct mesg_rec *recs;
+	char *out_nib, *out_hex;
+	int nrecs, rounds, i, j;
+	size_t len;
+
+	if(argc > 3) {
+		fprintf(stderr, "usage: hex_bench [RECORDS [ROUNDS]]\n");
+		return EXIT_FAILURE;
+	}
+	nrecs = argc > 1 ? atoi(argv[1]) : RECS_DEF;
+	rounds = argc > 2 ? atoi(argv[2]) : ROUNDS_DEF;
+	if(nrecs < 1 || rounds < 1) {
+		fprintf(stderr, "RECORDS and ROUNDS must be positive\n");
+		return EXIT_FAILURE;
+	}
+
+	recs = calloc(nrecs, sizeof(*recs));
+	out_nib = malloc((size_t)nrecs * HEX_MESG_MAX);
+	out_hex = malloc((size_t)nrecs * HEX_MESG_MAX);
+	if(!recs || !out_nib || !out_hex) {
+		perror("malloc");
+		return EXIT_FAILURE;
+	}
+
+	/* Mostly full frames, like a loaded bus */
+	srand(1);
+	for(i = 0; i < nrecs; i++) {
+		recs[i].id = i + 1;
+		recs[i].pgn = rand() & 0x3FFFF;
+		recs[i].tv_sec = 1400000000 + i / 1000;
+		recs[i].tv_usec = rand() % 1000000;
+		recs[i].iface = rand() & 1;
+		recs[i].daddr = rand();
+		recs[i].saddr = rand();
+		recs[i].dlen = i % 8 ? 8 : rand() % 9;
+		for(j = 0; j < 8; j++)
+			recs[i].data[j] = rand();
+	}
+
+	/* Both encoders must produce exactly the same stream */
+	for(i = 0, len = 0; i < nrecs; i++) {
+		size_t a, b;
+
+		a = nib_mesg(out_nib + len, 'M', &recs[i]) - (out_nib + len);
+		b = hex_mesg(out_hex + len, 'M', &recs[i]) - (out_hex + len);
+		if(a != b || memcmp(out_nib + len, out_hex + len, a)) {
+			fprintf(stderr, "encoders disagree on record %d\n", i);
+			return EXIT_FAILURE;
+		}
+		len += a;
+	}
+
+	double t_nib = bench(nib_mesg, recs, nrecs, rounds, out_nib);
+	double t_hex = bench(hex_mesg, recs, nrecs, rounds, out_hex);
+
+	printf("%d records x %d rounds, %.1f bytes/record\n", nrecs, rounds,
+			(double)len / nrecs);
+	printf("nib2hex: %7.2f ns/record, %8.1f MB/s\n", t_nib,
+			len / (t_nib * nrecs) * 1e3);
+	printf("hex:     %7.2f ns/record, %8.1f MB/s (%.2fx)\n", t_hex,
+			len / (t_hex * nrecs) * 1e3, t_nib / t_hex);
+
+	free(recs);
+	free(out_nib);
+	free(out_hex);
+
+	return EXIT_SUCCESS;
+}
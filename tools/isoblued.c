@@ -29,10 +29,17 @@
 
 #define ISOBLUED_VER	"isoblued - ISOBlue daemon"
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <limits.h>
 #include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 #include <argp.h>
 
@@ -41,6 +48,14 @@
 #include <sys/socket.h>
 #include <sys/ioctl.h>
 #include <sys/time.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
 
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/sdp.h>
@@ -53,6 +68,16 @@
 #include "../socketcan-isobus/isobus.h"
 
 #include "ring_buf.h"
+#include "reactor.h"
+#include "spsc_queue.h"
+#include "hex.h"
+#include "mesg_rec.h"
+#include "time_index.h"
+#include "mesg_filter.h"
+#include "pgn_index.h"
+#include "seg_log.h"
+#include "command.h"
+#include "metrics.h"
 
 enum opcode {
 	SET_FILTERS = 'F',
@@ -61,6 +86,8 @@ enum opcode {
 	ACK = 'A',
 	GET_PAST = 'P',
 	OLD_MESG = 'O',
+	GAP = 'G',
+	GET_TIME = 'T',
 	START = 'S',
 };
 
@@ -130,6 +157,194 @@ sdp_session_t *register_service(uint8_t rfcomm_channel)
     return session;
 }
 
+/*
+ * Client transports
+ *
+ * Each one sets up a listening socket for the same command/stream protocol.
+ * Its argument is whatever followed the ':' in the --transport option.
+ */
+static sdp_session_t *session = NULL;
+
+/* Bluetooth RFCOMM, registered with SDP; argument is the channel */
+static int listen_rfcomm(const char *arg, int backlog)
+{
+	struct sockaddr_rc rc_addr = { 0 };
+	socklen_t len;
+	int bt;
+
+	if((bt = socket(PF_BLUETOOTH, SOCK_STREAM | SOCK_NONBLOCK, BTPROTO_RFCOMM))
+			< 0) {
+		perror("socket (bt)");
+		return -1;
+	}
+	rc_addr.rc_family = AF_BLUETOOTH;
+	rc_addr.rc_bdaddr = *BDADDR_ANY;
+	rc_addr.rc_channel = arg ? atoi(arg) : 0;
+	if(bind(bt, (struct sockaddr *)&rc_addr, sizeof(rc_addr)) < 0) {
+		perror("bind bt");
+		return -1;
+	}
+	listen(bt, backlog);
+	len = sizeof(rc_addr);
+	if(getsockname(bt, (struct sockaddr *)&rc_addr, &len) < 0) {
+		perror("getsockname");
+		return -1;
+	}
+
+	/* Only one SDP record is needed */
+	if(!session) {
+		session = register_service(rc_addr.rc_channel);
+	}
+
+	return bt;
+}
+
+/* Unix domain stream socket; argument is the socket path */
+static int listen_unix(const char *arg, int backlog)
+{
+	struct sockaddr_un un_addr = { 0 };
+	int sock;
+
+	if(!arg || strlen(arg) >= sizeof(un_addr.sun_path)) {
+		fprintf(stderr, "Invalid unix socket path\n");
+		return -1;
+	}
+
+	if((sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0) {
+		perror("socket (unix)");
+		return -1;
+	}
+	un_addr.sun_family = AF_UNIX;
+	strcpy(un_addr.sun_path, arg);
+	unlink(arg);
+	if(bind(sock, (struct sockaddr *)&un_addr, sizeof(un_addr)) < 0) {
+		perror("bind unix");
+		return -1;
+	}
+	listen(sock, backlog);
+
+	return sock;
+}
+
+/* TCP on the loopback interface only; argument is the port */
+static int listen_tcp(const char *arg, int backlog)
+{
+	struct sockaddr_in in_addr = { 0 };
+	const int val = 1;
+	int sock;
+
+	if(!arg) {
+		fprintf(stderr, "No TCP port given\n");
+		return -1;
+	}
+
+	if((sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0) {
+		perror("socket (tcp)");
+		return -1;
+	}
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
+	in_addr.sin_family = AF_INET;
+	in_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	in_addr.sin_port = htons(atoi(arg));
+	if(bind(sock, (struct sockaddr *)&in_addr, sizeof(in_addr)) < 0) {
+		perror("bind tcp");
+		return -1;
+	}
+	listen(sock, backlog);
+
+	return sock;
+}
+
+static const struct transport {
+	const char *name;
+	int (*listen)(const char *arg, int backlog);
+} transports[] = {
+	{"rfcomm", listen_rfcomm},
+	{"unix", listen_unix},
+	{"tcp", listen_tcp},
+};
+
+/* Function to start listening on a transport given as <name>[:<arg>] */
+static int listen_transport(const char *spec, int backlog)
+{
+	const char *arg;
+	size_t len;
+	unsigned int i;
+
+	arg = strchr(spec, ':');
+	len = arg ? (size_t)(arg++ - spec) : strlen(spec);
+
+	for(i = 0; i < sizeof(transports) / sizeof(*transports); i++) {
+		if(strlen(transports[i].name) == len &&
+				!strncmp(transports[i].name, spec, len)) {
+			return transports[i].listen(arg, backlog);
+		}
+	}
+
+	fprintf(stderr, "Unknown transport %s\n", spec);
+	return -1;
+}
+
+/* Most messages taken from one ISOBUS socket per system call */
+#define RECV_BATCH_MAX	64
+#define RECV_BATCH_DEF	16
+/* Messages queued from each capture thread (2^order) */
+#define CAPTURE_ORDER	12
+/*
+ * Milliseconds a capture thread leaves messages in its socket when its queue
+ * is full, before looking for room again
+ */
+#define CAPTURE_RETRY	1
+/* Microseconds messages are held to merge interfaces in timestamp order */
+#define MERGE_DELAY_DEF	2000
+/* Most messages merged into the buffer at once */
+#define MERGE_BATCH	1024
+
+/* Group commit defaults for LevelDB writes */
+#define COMMIT_COUNT_DEF	1024
+#define COMMIT_AGE_DEF	0
+
+/* Messages queued for the storage thread, and when it is falling behind */
+#define STORE_ORDER_DEF	16
+#define STORE_HWM_DEF	75
+/* Seconds between entries in the time index */
+#define TIME_INDEX_DEF	10
+/* Most messages indexed by PGN before adding them to the write batch */
+#define PGN_INDEX_BATCH	4096
+/* Most PGNs a past data filter can have and still use the PGN index */
+#define PGN_INDEX_MAX	8
+/* Seconds between checks of storage against its limits */
+#define RETAIN_PERIOD	60
+/* Messages deleted per write once storage is over its limits */
+#define RETAIN_BATCH	16384
+/* Percent of retain-size trimmed down to, so deletes come in bulk */
+#define RETAIN_LOW	90
+/* Rows copied per write when moving a store over to 64-bit IDs */
+#define MIGRATE_BATCH	16384
+
+/* Milliseconds between saving the ring buffer's offsets */
+#define RING_CHECKPOINT	1000
+/* Milliseconds between writes of the metrics file */
+#define METRICS_PERIOD	5000
+
+/* Clients served at once by default */
+#define MAX_CLIENTS_DEF	4
+/* Most transports listened on at once */
+#define MAX_TRANSPORTS	4
+/* Buffer of records encoded for each client */
+#define OUT_BUF_SIZE	4096
+/* Send coalescing defaults, about one RFCOMM frame at the usual MTU */
+#define SEND_DELAY_DEF	10000
+#define SEND_SIZE_DEF	990
+/* Messages a client which ACKs may have unacknowledged by default */
+#define ACK_WINDOW_DEF	1024
+/* Buffer for reassembling commands from each client */
+#define CMD_BUF_SIZE	0x03FFFF
+/* Messages from clients queued for each interface (a power of 2) */
+#define TX_QUEUE	256
+/* Milliseconds before retrying when an interface is out of buffers */
+#define TX_RETRY	1
+
 /* argp goodies */
 #ifdef BUILD_NUM
 const char *argp_program_version = ISOBLUED_VER "\n" BUILD_NUM;
@@ -142,8 +357,47 @@ static char doc[] = "Connect ISOBlue to IFACE(s), using BUF_FILE as a buffer.";
 static struct argp_option options[] = {
 	{NULL, 0, NULL, 0, "About", -1},
 	{NULL, 0, NULL, 0, "Configuration", 0},
-	{"channel", 'c', "<channel>", 0, "RFCOMM Channel", 0},
+	{"channel", 'c', "<channel>", 0, "RFCOMM Channel (default transport)", 0},
 	{"buffer-order", 'b', "<order>", 0, "Use a 2^<order> MB buffer", 0},
+	{"recv-batch", 'r', "<count>", 0,
+		"Receive up to <count> messages per system call", 0},
+	{"capture-threads", 'T', NULL, 0,
+		"Read each IFACE on its own thread, merging them by timestamp", 0},
+	{"capture-cpus", 'C', "<cpu,...>", 0,
+		"Pin each IFACE's capture thread to a CPU, in order (implies -T)", 0},
+	{"merge-delay", 'D', "<usecs>", 0,
+		"Hold messages up to <usecs> to merge IFACEs in timestamp order", 0},
+	{"commit-count", 'n', "<count>", 0,
+		"Commit at most <count> messages to LevelDB at once", 0},
+	{"commit-age", 'a', "<msecs>", 0,
+		"Hold LevelDB writes for up to <msecs> (0 commits every wakeup)", 0},
+	{"store-queue", 'q', "<order>", 0,
+		"Queue up to 2^<order> messages waiting to be stored", 0},
+	{"store-hwm", 'w', "<percent>", 0,
+		"Storage is behind once its queue is <percent> full", 0},
+	{"time-index", 'i', "<secs>", 0,
+		"Index stored messages by receive time every <secs>", 0},
+	{"retain-size", 'z', "<MB>", 0,
+		"Delete the oldest messages once storage passes <MB> (0 keeps all)",
+		0},
+	{"retain-age", 'e', "<secs>", 0,
+		"Delete messages received over <secs> ago (0 keeps all)", 0},
+	{"log-segment", 'l', "<MB>", 0,
+		"Store messages in a log of <MB> segments instead of LevelDB", 0},
+	{"metrics", 'M', "<file>", 0,
+		"Write metrics to <file> every few seconds, in Prometheus text format",
+		0},
+	{"max-clients", 'm', "<count>", 0, "Serve up to <count> clients at once",
+		0},
+	{"send-delay", 'd', "<usecs>", 0,
+		"Hold records up to <usecs> to send them together (0 sends at once)", 0},
+	{"send-size", 's', "<bytes>", 0,
+		"Send once <bytes> are waiting, without waiting out send-delay", 0},
+	{"ack-window", 'k', "<count>", 0,
+		"Send clients which ACK up to <count> messages ahead of their ACKs",
+		0},
+	{"transport", 't', "<transport>", 0, "Listen for clients on <transport>: "
+		"rfcomm[:<channel>], unix:<path> or tcp:<port> (may be repeated)", 0},
 	{ 0 }
 };
 struct arguments {
@@ -152,6 +406,25 @@ struct arguments {
 	int nifaces;
 	int channel;
 	int buf_order;
+	int recv_batch;
+	int commit_count;
+	int commit_age;
+	int store_order;
+	int store_hwm;
+	int time_index;
+	long retain_size;
+	long retain_age;
+	int log_segment;
+	char *metrics;
+	int max_clients;
+	int send_delay;
+	int send_size;
+	int ack_window;
+	bool capture_threads;
+	char *capture_cpus;
+	long merge_delay;
+	char *transports[MAX_TRANSPORTS];
+	int ntransports;
 };
 static error_t parse_opt(int key, char *arg, struct argp_state *state)
 {
@@ -166,6 +439,127 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
 		arguments->buf_order = atoi(arg);
 		break;
 
+	case 'r':
+		arguments->recv_batch = atoi(arg);
+		if(arguments->recv_batch < 1 ||
+				arguments->recv_batch > RECV_BATCH_MAX) {
+			argp_error(state, "recv-batch must be between 1 and %d",
+					RECV_BATCH_MAX);
+		}
+		break;
+
+	case 'n':
+		arguments->commit_count = atoi(arg);
+		if(arguments->commit_count < 1) {
+			argp_error(state, "commit-count must be at least 1");
+		}
+		break;
+
+	case 'a':
+		arguments->commit_age = atoi(arg);
+		if(arguments->commit_age < 0) {
+			argp_error(state, "commit-age must not be negative");
+		}
+		break;
+
+	case 'q':
+		arguments->store_order = atoi(arg);
+		if(arguments->store_order < 4 || arguments->store_order > 24) {
+			argp_error(state, "store-queue must be between 4 and 24");
+		}
+		break;
+
+	case 'w':
+		arguments->store_hwm = atoi(arg);
+		if(arguments->store_hwm < 1 || arguments->store_hwm > 100) {
+			argp_error(state, "store-hwm must be between 1 and 100");
+		}
+		break;
+
+	case 'i':
+		arguments->time_index = atoi(arg);
+		if(arguments->time_index < 1) {
+			argp_error(state, "time-index must be at least 1");
+		}
+		break;
+
+	case 'z':
+		arguments->retain_size = atol(arg);
+		if(arguments->retain_size < 0) {
+			argp_error(state, "retain-size must not be negative");
+		}
+		break;
+
+	case 'e':
+		arguments->retain_age = atol(arg);
+		if(arguments->retain_age < 0) {
+			argp_error(state, "retain-age must not be negative");
+		}
+		break;
+
+	case 'l':
+		arguments->log_segment = atoi(arg);
+		if(arguments->log_segment < 1 || arguments->log_segment > 4095) {
+			argp_error(state, "log-segment must be between 1 and 4095");
+		}
+		break;
+
+	case 'M':
+		arguments->metrics = arg;
+		break;
+
+	case 't':
+		if(arguments->ntransports == MAX_TRANSPORTS) {
+			argp_error(state, "at most %d transports", MAX_TRANSPORTS);
+		}
+		arguments->transports[arguments->ntransports++] = arg;
+		break;
+
+	case 'm':
+		arguments->max_clients = atoi(arg);
+		if(arguments->max_clients < 1) {
+			argp_error(state, "max-clients must be at least 1");
+		}
+		break;
+
+	case 'd':
+		arguments->send_delay = atoi(arg);
+		if(arguments->send_delay < 0) {
+			argp_error(state, "send-delay must not be negative");
+		}
+		break;
+
+	case 's':
+		arguments->send_size = atoi(arg);
+		if(arguments->send_size < 1 || arguments->send_size > OUT_BUF_SIZE / 2) {
+			argp_error(state, "send-size must be between 1 and %d",
+					OUT_BUF_SIZE / 2);
+		}
+		break;
+
+	case 'k':
+		arguments->ack_window = atoi(arg);
+		if(arguments->ack_window < 1) {
+			argp_error(state, "ack-window must be positive");
+		}
+		break;
+
+	case 'T':
+		arguments->capture_threads = true;
+		break;
+
+	case 'C':
+		arguments->capture_threads = true;
+		arguments->capture_cpus = arg;
+		break;
+
+	case 'D':
+		arguments->merge_delay = atol(arg);
+		if(arguments->merge_delay < 0) {
+			argp_error(state, "merge-delay must not be negative");
+		}
+		break;
+
 	case ARGP_KEY_ARG:
 		if(state->arg_num == 0)
 			arguments->file = arg;
@@ -217,512 +611,2980 @@ static struct argp argp = {
 };
 
 /* Leveldb stuff */
+#define LEVELDB_PATH	"isoblued_db"
 leveldb_t *db;
 leveldb_options_t *db_options;
 leveldb_readoptions_t *db_roptions;
+/* For replaying past data, which should not push recent reads from cache */
+leveldb_readoptions_t *db_scan_roptions;
 leveldb_writeoptions_t *db_woptions;
 char *db_err = NULL;
-typedef uint32_t db_key_t;
-db_key_t db_id = 1, db_stop = 0;
+/*
+ * Messages are stored under their ID, 8 bytes big-endian, so LevelDB's own
+ * byte order is ID order; the next ID is stored under ID 0, before them all
+ */
+typedef uint64_t db_key_t;
+db_key_t db_id = 1;
 const db_key_t LEVELDB_ID_KEY = 0;
-leveldb_iterator_t *db_iter;
+/* Stores from before IDs were 64-bit, moved over on start up */
+#define LEVELDB_V1_PATH	LEVELDB_PATH ".v1"
+#define LEVELDB_NEW_PATH	LEVELDB_PATH ".new"
+#define TIME_INDEX_PATH	"isoblued_time.idx"
+#define TIME_INDEX_NEW_PATH	TIME_INDEX_PATH ".v2"
+/* Layout of the records in the ring buffer, saved with its offsets */
+#define RING_FORMAT	2
+/* Pending group commit, only touched by the storage thread */
+leveldb_writebatch_t *db_batch;
+struct pgn_index_batch db_pgn_batch;
+int db_batch_cnt = 0;
+db_key_t db_batch_id;
+struct timespec db_batch_time;
+int commit_count = COMMIT_COUNT_DEF;
+int commit_age = COMMIT_AGE_DEF;
+/* Log of segments used instead of LevelDB, when asked for */
+#define SEG_LOG_PATH	"isoblued_log"
+static struct seg_log db_log;
+static bool db_use_log = false;
+/* Ordering of stores from before IDs were 64-bit, only to move them over */
 static void leveldb_cmp_destroy(void *arg __attribute__ ((unused))) { }
 static int leveldb_cmp_compare(void *arg __attribute__ ((unused)) ,
-		const char *a, size_t alen __attribute__ ((unused)),
-		const char *b, size_t blen __attribute__ ((unused))) {
-	return *((db_key_t *)a) - *((db_key_t *)b);
+		const char *a, size_t alen, const char *b, size_t blen) {
+	return pgn_index_compare_v1(a, alen, b, blen);
 }
 static const char * leveldb_cmp_name(void *arg __attribute__ ((unused))) {
 	return "isoblued.v1";
 }
-/* Magic numbers related to past data... */
-#define PAST_THRESH	200
-#define PAST_CNT	4
+/* Daemon statistics, printed on SIGUSR1 */
+struct stats {
+	unsigned long long rx_mesgs;
+	unsigned long long rx_calls;
+	unsigned long long merge_held;
+	unsigned long long tx_bytes;
+	unsigned long long tx_sends;
+	unsigned long long tx_full;
+	unsigned long long tx_held_us;
+	unsigned long long tx_held_max_us;
+	struct metrics_hist tx_held_hist;
+	int tx_max;
+	unsigned long long ring_lost;
+	unsigned long long client_skipped;
+	unsigned long long client_gaps;
+	unsigned long long client_catch_ups;
+	unsigned long long acks;
+	unsigned long long ack_stale;
+	unsigned long long ack_window_full;
+	struct metrics_hist ack_rtt_hist;
+	unsigned long long bus_queued;
+	unsigned long long bus_sent;
+	unsigned long long bus_calls;
+	unsigned long long bus_failed;
+	unsigned long long bus_held;
+	unsigned long long replay_recs;
+	unsigned long long replay_us;
+	unsigned long long store_dropped;
+	unsigned long long store_hwm_hits;
+	unsigned long store_depth_max;
+	/* Kept by the storage thread */
+	atomic_ullong db_mesgs;
+	atomic_ullong db_commits;
+	atomic_ullong db_stall_us;
+	atomic_ullong db_stall_max_us;
+	struct metrics_hist db_commit_hist;
+	/* Kept by the retention thread */
+	atomic_ullong retain_mesgs;
+};
+static struct stats stats;
+static volatile sig_atomic_t stats_req = 0, stop_req = 0;
+static int recv_batch = RECV_BATCH_DEF;
 
-/* Function to check if any messages are buffered */
-static inline void check_send(struct ring_buffer *buf, int rc,
-		fd_set *write_fds)
+static void stats_handler(int sig __attribute__ ((unused)))
 {
-	if(ring_buffer_unread_bytes(buf) || db_iter) {
-		FD_SET(rc, write_fds);
-	} else {
-		FD_CLR(rc, write_fds);
-	}
+	stats_req = 1;
 }
 
-/* Function to wait for one or more file descriptors to be ready */
-static inline int wait_func(int n_fds, fd_set *tmp_rfds, fd_set *tmp_wfds)
+static void stop_handler(int sig __attribute__ ((unused)))
 {
-	int ret;
+	stop_req = 1;
+}
+
+/*
+ * Storage thread
+ *
+ * Messages are handed to it over a lock-free queue, so the CAN sockets are
+ * never left unread while LevelDB writes (or compacts).
+ */
+static struct spsc_queue store_q;
+static unsigned long store_hwm;
+static pthread_t store_thread;
+/* Wakes the storage thread, and tells the main thread a flush finished */
+static int store_wake_fd, store_done_fd;
+static atomic_bool store_sleeping, store_flush, store_stop;
+/* Next message to be queued, and first one not yet committed */
+static _Atomic db_key_t store_offered_id, store_committed_id;
+/* Where each stretch of receive time starts in storage */
+static struct time_index time_idx;
 
-	if((ret = select(n_fds + 1, tmp_rfds, tmp_wfds, NULL, NULL)) < 0) {
-		perror("select");
+/*
+ * Retention thread
+ *
+ * Deletes the oldest messages once storage is over its size or age limit,
+ * then compacts them away, without holding up the storage thread.
+ */
+static unsigned long long retain_size;
+static unsigned long retain_age;
+static pthread_t retain_thread;
+static int retain_wake_fd;
+static atomic_bool retain_stop;
+/* First message still stored, and bytes of storage on disk */
+static _Atomic db_key_t retain_oldest_id;
+static atomic_ullong retain_bytes;
 
-		switch(errno) {
-		case EINTR:
-			return 0;
+/*
+ * Capture threads, one per interface when asked for
+ *
+ * Each reads its socket into its own lock-free queue, so a burst on one bus
+ * does not hold up reading another, or serving clients. The main thread
+ * merges the queues in timestamp order, giving IDs as it puts them in the
+ * buffer.
+ */
+struct capture {
+	pthread_t thread;
+	int sock;
+	int iface;
+	/* CPU the thread is pinned to, or -1 */
+	int cpu;
+	struct spsc_queue q;
+	/*
+	 * Receive time (in usecs) every message before which is queued, as of
+	 * the last time the thread found its socket empty
+	 */
+	atomic_ullong watermark;
+	/* Kept by the thread */
+	atomic_ullong calls, full;
+	/* Calls as of the last merge */
+	unsigned long long calls_seen;
+};
+static bool capture_threads = false;
+static const char *capture_cpus;
+static struct capture *captures;
+static int ncaptures;
+static long merge_delay = MERGE_DELAY_DEF;
+/* Wakes the main thread to merge, and stops the capture threads */
+static int capture_wake_fd, capture_stop_fd;
+static atomic_bool capture_pending, capture_stop;
+
+static void print_stats(void)
+{
+	unsigned long long db_mesgs, db_commits;
 
-		default:
-			exit(EXIT_FAILURE);
+	printf("rx: %llu messages in %llu calls (%.2f per call)\n",
+			stats.rx_mesgs, stats.rx_calls, stats.rx_calls ?
+			(double)stats.rx_mesgs / stats.rx_calls : 0.0);
+	if(captures) {
+		unsigned long long full = 0;
+		int i;
+
+		for(i = 0; i < ncaptures; i++) {
+			full += metrics_get(&captures[i].full);
 		}
+		printf("capture: %d threads, queues full %llu times, merge held "
+				"back %llu times\n", ncaptures, full, stats.merge_held);
 	}
+	printf("tx: %llu bytes in %llu sends (%.2f per send, %d at most), "
+			"%llu sent full\n", stats.tx_bytes, stats.tx_sends,
+			stats.tx_sends ? (double)stats.tx_bytes / stats.tx_sends : 0.0,
+			stats.tx_max, stats.tx_full);
+	printf("tx: held %.3f ms on average, %.3f ms at most\n", stats.tx_sends ?
+			stats.tx_held_us / 1000.0 / stats.tx_sends : 0.0,
+			stats.tx_held_max_us / 1000.0);
+	printf("ack: %llu acknowledgements (%llu stale), round trip %.3f ms on "
+			"average, window full %llu times\n", stats.acks, stats.ack_stale,
+			stats.ack_rtt_hist.count ? stats.ack_rtt_hist.sum / 1000.0 /
+			stats.ack_rtt_hist.count : 0.0, stats.ack_window_full);
+	printf("bus: %llu messages queued, %llu sent in %llu calls, %llu failed, "
+			"clients held back %llu times\n", stats.bus_queued,
+			stats.bus_sent, stats.bus_calls, stats.bus_failed, stats.bus_held);
+	printf("replay: %llu records in %.3f s (%.0f records/s)\n",
+			stats.replay_recs, stats.replay_us / 1e6, stats.replay_us ?
+			stats.replay_recs * 1e6 / stats.replay_us : 0.0);
+	db_mesgs = metrics_get(&stats.db_mesgs);
+	db_commits = metrics_get(&stats.db_commits);
+	printf("db: %llu messages in %llu commits (%.2f per commit)\n",
+			db_mesgs, db_commits, db_commits ?
+			(double)db_mesgs / db_commits : 0.0);
+	printf("db: stalled %.3f ms in total, %.3f ms at most\n",
+			metrics_get(&stats.db_stall_us) / 1000.0,
+			metrics_get(&stats.db_stall_max_us) / 1000.0);
+	printf("store: %lu queued (%lu at most), %llu times behind, "
+			"%llu messages not stored\n", spsc_queue_depth(&store_q),
+			stats.store_depth_max, stats.store_hwm_hits,
+			stats.store_dropped);
+	printf("retain: %.1f MB stored from message %llu on, "
+			"%llu messages deleted\n", metrics_get(&retain_bytes) / 1048576.0,
+			(unsigned long long)retain_oldest_id,
+			metrics_get(&stats.retain_mesgs));
+	fflush(stdout);
+}
 
-	return ret;
+/* Milliseconds since the given time */
+static inline long ms_since(const struct timespec *then)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - then->tv_sec) * 1000 +
+		(now.tv_nsec - then->tv_nsec) / 1000000;
 }
 
-/* Fast method to convert to hex */
-static inline char nib2hex(uint_fast8_t nib)
+/* Microseconds since the given time */
+static inline long us_since(const struct timespec *then)
 {
-	nib &= 0x0F;
+	struct timespec now;
 
-	return nib >= 10 ? nib - 10 + 'a' : nib + '0';
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - then->tv_sec) * 1000000 +
+		(now.tv_nsec - then->tv_nsec) / 1000;
 }
 
-/* Function to handle incoming ISOBUS message(s) */
-static inline int read_func(int sock, int iface, struct ring_buffer *buf)
+/* Function to write out the pending batch of messages, if any */
+static int db_commit(void)
 {
-	/* Construct msghdr to use to recevie messages from socket */
-	static struct isobus_mesg mes;
-	static struct sockaddr_can addr;
-	static struct iovec iov = {&mes, sizeof(mes)};
-	static char cmsgb[CMSG_SPACE(sizeof(struct sockaddr_can)) +
-		CMSG_SPACE(sizeof(struct timeval))];
-	static struct msghdr msg = {&addr, sizeof(addr), &iov, 1,
-			cmsgb, sizeof(cmsgb), 0};
+	struct timespec start, end;
+	unsigned long long us;
+	char *err = NULL;
+	char key[PGN_INDEX_ID_LEN], val[PGN_INDEX_ID_LEN];
 
-	if(recvmsg(sock, &msg, MSG_DONTWAIT) <= 0) {
-		perror("recvmsg");
-		exit(EXIT_FAILURE);
+	if(!db_batch_cnt) {
+		return 0;
 	}
 
-	/* Get saddr and approximate arrival time */
-	struct sockaddr_can daddr = { 0 };
-	struct timeval tv = { 0 };
-	struct cmsghdr *cmsg;
-	for(cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
-			cmsg = CMSG_NXTHDR(&msg, cmsg)) {
-		if(cmsg->cmsg_level == SOL_CAN_ISOBUS &&
-				cmsg->cmsg_type == CAN_ISOBUS_DADDR) {
-			memcpy(&daddr, CMSG_DATA(cmsg), sizeof(daddr));
-		} else if(cmsg->cmsg_level == SOL_SOCKET &&
-				cmsg->cmsg_type == SO_TIMESTAMP) {
-			memcpy(&tv, CMSG_DATA(cmsg), sizeof(tv));
-		}
-	}
-
-	char *sp, *cp;
-	cp = sp = ring_buffer_tail_address(buf);
-
-	/* Print opcode (1 char) */
-	*(cp++) = MESG;
-	/* Print CAN interface index (1 nibble) */
-	*(cp++) = nib2hex(iface);
-	/* Print DB key */
-	*(cp++) = nib2hex(db_id >> 28);
-	*(cp++) = nib2hex(db_id >> 24);
-	*(cp++) = nib2hex(db_id >> 20);
-	*(cp++) = nib2hex(db_id >> 16);
-	*(cp++) = nib2hex(db_id >> 12);
-	*(cp++) = nib2hex(db_id >> 8);
-	*(cp++) = nib2hex(db_id >> 4);
-	*(cp++) = nib2hex(db_id);
-	/* Print PGN (5 nibbles) */
-	*(cp++) = nib2hex(mes.pgn >> 16);
-	*(cp++) = nib2hex(mes.pgn >> 12);
-	*(cp++) = nib2hex(mes.pgn >> 8);
-	*(cp++) = nib2hex(mes.pgn >> 4);
-	*(cp++) = nib2hex(mes.pgn);
-	/* Print destination address (2 nibbles) */
-	*(cp++) = nib2hex(daddr.can_addr.isobus.addr >> 4);
-	*(cp++) = nib2hex(daddr.can_addr.isobus.addr);
-	/* Print data bytes (4 nibbles length) */
-	*(cp++) = nib2hex(mes.dlen >> 12);
-	*(cp++) = nib2hex(mes.dlen >> 8);
-	*(cp++) = nib2hex(mes.dlen >> 4);
-	*(cp++) = nib2hex(mes.dlen);
-	int j;
-	for(j = 0; j < mes.dlen; j++)
-	{
-		*(cp++) = nib2hex(mes.data[j] >> 4);
-		*(cp++) = nib2hex(mes.data[j]);
-	}
-	/* Print timestamp (8 nibbles sec, 5 nibbles usec) */
-	*(cp++) = nib2hex(tv.tv_sec >> 28);
-	*(cp++) = nib2hex(tv.tv_sec >> 24);
-	*(cp++) = nib2hex(tv.tv_sec >> 20);
-	*(cp++) = nib2hex(tv.tv_sec >> 16);
-	*(cp++) = nib2hex(tv.tv_sec >> 12);
-	*(cp++) = nib2hex(tv.tv_sec >> 8);
-	*(cp++) = nib2hex(tv.tv_sec >> 4);
-	*(cp++) = nib2hex(tv.tv_sec);
-	*(cp++) = nib2hex(tv.tv_usec >> 16);
-	*(cp++) = nib2hex(tv.tv_usec >> 12);
-	*(cp++) = nib2hex(tv.tv_usec >> 8);
-	*(cp++) = nib2hex(tv.tv_usec >> 4);
-	*(cp++) = nib2hex(tv.tv_usec);
-	/* Print source address (2 nibbles) */
-	*(cp++) = nib2hex(addr.can_addr.isobus.addr >> 4);
-	*(cp++) = nib2hex(addr.can_addr.isobus.addr);
-	/* Print message ending */
-	*(cp++) = '\n';
-
-	ring_buffer_tail_advance(buf, cp-sp);
-
-	/* Put messaged in leveldb */
-	leveldb_put(db, db_woptions, (char *)&db_id, sizeof(db_id),
-			sp+1, cp-sp-1, &db_err);
-	if(db_err) {
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if(db_use_log) {
+		/* Messages are already in the log, this lets them be read */
+		seg_log_commit(&db_log);
+	} else {
+		/* Only update the next ID once per batch */
+		pgn_index_batch_flush(&db_pgn_batch, db_batch);
+		pgn_index_put_id(key, LEVELDB_ID_KEY);
+		pgn_index_put_id(val, db_batch_id);
+		leveldb_writebatch_put(db_batch, key, sizeof(key), val, sizeof(val));
+		leveldb_write(db, db_woptions, db_batch, &err);
+		leveldb_writebatch_clear(db_batch);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	/* Time spent in the write, including any compaction it waited on */
+	us = (end.tv_sec - start.tv_sec) * 1000000ULL +
+		(end.tv_nsec - start.tv_nsec) / 1000;
+	metrics_add(&stats.db_stall_us, us);
+	if(us > metrics_get(&stats.db_stall_max_us)) {
+		atomic_store_explicit(&stats.db_stall_max_us, us,
+				memory_order_relaxed);
+	}
+	metrics_hist_add(&stats.db_commit_hist, us);
+	metrics_add(&stats.db_mesgs, db_batch_cnt);
+	metrics_add(&stats.db_commits, 1);
+	db_batch_cnt = 0;
+	if(err) {
 		fprintf(stderr, "Leveldb write error.\n");
-		leveldb_free(db_err);
-		db_err = NULL;
+		leveldb_free(err);
 		return -1;
 	}
-	db_id++;
-	leveldb_put(db, db_woptions, (char *)&LEVELDB_ID_KEY, sizeof(db_key_t),
-			(char *)&db_id, sizeof(db_id), &db_err);
+	atomic_store(&store_committed_id, db_batch_id);
 
-	return 1;
+	return 0;
 }
 
-/* Function to send buffered messages over Bluetooth */
-static inline int send_func(int rc, struct ring_buffer *buf)
+/* Function to find ms until the pending batch must be committed, or -1 */
+static inline int db_commit_timeout(void)
 {
-	int chars, sent;
-	char *buffer;
+	long ms;
 
-	chars = ring_buffer_unread_bytes(buf);
-
-	/* Try to queue up past data for sending */
-	if(db_iter && chars < PAST_THRESH) {
-		int i;
-		char *sp, *cp;
-		sp = cp = ring_buffer_tail_address(buf);
-		for(i = 0; i < PAST_CNT && leveldb_iter_valid(db_iter); i++) {
-			size_t len;
-			char *val;
-
-			val = (char *)leveldb_iter_key(db_iter, &len);
-			if(*((db_key_t *)val) >= db_stop) {
-				/* Past data is done */
-				leveldb_iter_destroy(db_iter);
-				*(cp++) = OLD_MESG;
-				*(cp++) = '0';
-				*(cp++) = '0';
-				*(cp++) = '0';
-				*(cp++) = '0';
-				*(cp++) = '0';
-				*(cp++) = '0';
-				*(cp++) = '0';
-				*(cp++) = '0';
-				*(cp++) = '0';
-				*(cp++) = '\n';
-				*(cp++) = OLD_MESG;
-				*(cp++) = '1';
-				*(cp++) = '0';
-				*(cp++) = '0';
-				*(cp++) = '0';
-				*(cp++) = '0';
-				*(cp++) = '0';
-				*(cp++) = '0';
-				*(cp++) = '0';
-				*(cp++) = '0';
-				*(cp++) = '\n';
-				db_iter = NULL;
-				break;
-			}
+	if(!db_batch_cnt) {
+		return -1;
+	}
 
-			*(cp++) = OLD_MESG;
-			val = (char *)leveldb_iter_value(db_iter, &len);
-			memcpy(cp, val, len);
-			cp += len;
+	ms = commit_age - ms_since(&db_batch_time);
 
-			leveldb_iter_next(db_iter);
-		}
-		ring_buffer_tail_advance(buf, cp-sp);
-	}
+	return ms < 0 ? 0 : ms;
+}
 
-	buffer = ring_buffer_curs_address(buf);
-	chars = ring_buffer_unread_bytes(buf);
+/* Past data records decoded ahead of encoding them for a client */
+#define REPLAY_PREFETCH	256
+/* Most times the client buffer is refilled per writable event in a replay */
+#define REPLAY_BURST	16
 
-	if((sent = send(rc, buffer, chars, MSG_DONTWAIT)) < 0) {
-		perror("send");
+/* Framing of records streamed to a client, chosen with START */
+enum stream_fmt {
+	FMT_HEX,
+	FMT_BIN,
+};
 
-		switch(errno) {
-		case EAGAIN:
-			return 0;
+/*
+ * Function to print a gap record, for messages overwritten before a client
+ * was sent them; first and last are the IDs of the first and last lost,
+ * so they can be asked for with GET_PAST
+ *
+ * Hex: opcode, first (8 nibbles), last (8 nibbles), newline
+ * Binary: opcode (1), first (4), last (4)
+ */
+static inline char *encode_gap(char *cp, enum stream_fmt fmt, db_key_t first,
+		db_key_t last)
+{
+	*(cp++) = GAP;
+	switch(fmt) {
+	case FMT_BIN:
+		cp = put_le32(cp, first);
+		return put_le32(cp, last);
 
-		default:
-			return -1;
-		}
+	case FMT_HEX:
+	default:
+		cp = hex_val(cp, first, 8);
+		cp = hex_val(cp, last, 8);
+		*(cp++) = '\n';
+		return cp;
 	}
+}
 
-	ring_buffer_curs_advance(buf, sent);
+/* Function to print a message record in the negotiated format */
+static inline char *encode_mesg(char *cp, enum stream_fmt fmt, char op,
+		const struct mesg_rec *r)
+{
+	switch(fmt) {
+	case FMT_BIN:
+		return bin_mesg(cp, op, r);
 
-	return 1;
+	case FMT_HEX:
+	default:
+		return hex_mesg(cp, op, r);
+	}
 }
 
-/* Function to handle commands from Bluetooth */
-static inline int command_func(int rc, struct ring_buffer *buf, int *s)
+/* Function to rouse an eventfd */
+static inline void store_signal(int fd)
 {
-	/* Buffer for reassembling commands */
-	#define CMD_BUF_SIZE	0x03FFFF
-	static char buffer[CMD_BUF_SIZE] = { 0 };
-	static int curs = 0, tail = 0;
+	const uint64_t val = 1;
 
-	int chars;
-	chars = recv(rc, buffer+tail, CMD_BUF_SIZE-tail, MSG_DONTWAIT);
-	if(chars < 0) {
-		perror("read");
-		return -1;
+	if(write(fd, &val, sizeof(val)) < 0) {
+		perror("write (eventfd)");
 	}
-	tail += chars;
-
-	while(true){
-		bool done = false;
-		while(curs < tail) {
-			if(buffer[curs] == '\n' || buffer[curs] == '\r') {
-				done = true;
-				buffer[curs++] = '\0';
-				break;
-			}
+}
 
-			curs++;
-		}
-		if(!done) {
-			return 0;
+/* Function to store batches of queued messages, run by the storage thread */
+static void *store_func(void *arg __attribute__ ((unused)))
+{
+	bool flush = false, behind = false;
+
+	while(true) {
+		struct mesg_rec *recs;
+		unsigned long i, n, limit;
+		db_key_t offered;
+		bool stop;
+
+		/* Everything offered after a flush request is seen is included */
+		flush |= atomic_exchange(&store_flush, false);
+		stop = atomic_load(&store_stop);
+		offered = atomic_load(&store_offered_id);
+
+		/* When behind, catch up with batches as large as the queue */
+		if(spsc_queue_depth(&store_q) >= store_hwm) {
+			behind = true;
 		}
+		limit = behind ? store_q.count_elems : (unsigned long)commit_count;
 
-		char op;
-		int sock;
-		char *args, *end;
-		bool invalid;
-
-		op = buffer[0];
-		sock = buffer[1] >= 'a' ? buffer[1] + 10 - 'a' : buffer[1] - '0';
-		args = buffer + 2;
-		end = buffer + curs;
-		invalid = false;
-
-		printf("Received command %c %s\n", op, args);
-
-		switch(op) {
-		case START:
-		{
-			char *cp, *sp;
+		if((n = spsc_queue_peek(&store_q, (void **)&recs))) {
+			if(!db_batch_cnt) {
+				clock_gettime(CLOCK_MONOTONIC, &db_batch_time);
+			}
+			if(n > limit - db_batch_cnt) {
+				n = limit - db_batch_cnt;
+			}
 
-			/* Reset BT buffer */
-			ring_buffer_clear(buf);
+			for(i = 0; i < n; i++) {
+				char val[HEX_MESG_MAX], key[PGN_INDEX_ID_LEN];
+				char *ve;
 
-			/* Reset iterator */
-			if(db_iter) {
-				leveldb_iter_destroy(db_iter);
-				db_iter = NULL;
+				if(db_use_log) {
+					/* The log keeps records as they are */
+					if(seg_log_append(&db_log, recs[i].id, &recs[i],
+								sizeof(recs[i])) < 0) {
+						perror("seg_log_append");
+						exit(EXIT_FAILURE);
+					}
+				} else {
+					/* LevelDB keeps them in the hex format, indexed by PGN */
+					ve = hex_mesg(val, MESG, &recs[i]);
+					pgn_index_put_id(key, recs[i].id);
+					leveldb_writebatch_put(db_batch, key, sizeof(key), val+1,
+							ve-val-1);
+					pgn_index_batch_add(&db_pgn_batch, db_batch, recs[i].pgn,
+							recs[i].id);
+				}
+				if(time_index_note(&time_idx, recs[i].tv_sec, recs[i].id)
+						< 0) {
+					perror("time index");
+				}
 			}
+			db_batch_id = recs[n-1].id + 1;
+			db_batch_cnt += n;
+			spsc_queue_pop(&store_q, n);
 
-			/* Repsond with current ID */
-			sp = cp = ring_buffer_tail_address(buf);
-			*(cp++) = START;
-			*(cp++) = 'f';
-			*(cp++) = nib2hex(db_id >> 28);
-			*(cp++) = nib2hex(db_id >> 24);
-			*(cp++) = nib2hex(db_id >> 20);
-			*(cp++) = nib2hex(db_id >> 16);
-			*(cp++) = nib2hex(db_id >> 12);
-			*(cp++) = nib2hex(db_id >> 8);
-			*(cp++) = nib2hex(db_id >> 4);
-			*(cp++) = nib2hex(db_id);
-			*(cp++) = '\n';
-			ring_buffer_tail_advance(buf, cp-sp);
-
-			break;
+			if((unsigned long)db_batch_cnt >= limit) {
+				if(db_commit() < 0) {
+					exit(EXIT_FAILURE);
+				}
+				behind = false;
+			}
+			continue;
 		}
-		case GET_PAST:
-		{
-			db_key_t key_start;
 
-			if(sscanf(args, "%8x%8x", &key_start, &db_stop) < 2) {
-				fprintf(stderr, "Invalid past data command\n");
-				break;
+		/* Queue is empty, so commit unless the batch can wait */
+		if(flush || stop || behind || db_commit_timeout() == 0) {
+			if(db_commit() < 0) {
+				exit(EXIT_FAILURE);
 			}
-
-			db_iter = leveldb_create_iterator(db, db_roptions);
-			leveldb_iter_seek(db_iter, (char *)&key_start, sizeof(db_key_t));
-
+			behind = false;
+		}
+		if(!db_batch_cnt) {
+			/* Anything offered but never queued was dropped */
+			atomic_store(&store_committed_id, offered);
+		}
+		if(flush) {
+			flush = false;
+			store_signal(store_done_fd);
+		}
+		if(stop) {
 			break;
 		}
-		case SET_FILTERS:
-		{
-			char *p;
-			struct isobus_filter *filts;
-			int nfilts;
-
-			if(sscanf(args, "%5x", &nfilts) < 1) {
-				fprintf(stderr, "Invalid filter command\n");
-				break;
-			}
-			p = args + 5;
-
-			if(nfilts == 0) {
-				/* Receive everything when 0 filters given */
-				nfilts = 1;
-				filts = malloc(sizeof(*filts));
-
-				filts[0].pgn = 0;
-				filts[0].pgn_mask = 0;
-				filts[0].daddr = 0;
-				filts[0].daddr_mask = 0;
-				filts[0].saddr = 0;
-				filts[0].saddr_mask = 0;
-			} else {
-				filts = calloc(nfilts, sizeof(*filts));
 
-				int i;
-				for(i = 0; i < nfilts; i++) {
-					int pgn;
+		/* Sleep, unless something was queued since last looking */
+		atomic_store(&store_sleeping, true);
+		atomic_thread_fence(memory_order_seq_cst);
+		if(!spsc_queue_depth(&store_q) && !atomic_load(&store_flush) &&
+				!atomic_load(&store_stop)) {
+			struct pollfd pfd = { store_wake_fd, POLLIN, 0 };
 
-					if((p + 5) >= end || sscanf(p, "%5x", &pgn) < 1) {
-						invalid = true;
-						fprintf(stderr, "Invalid filter command\n");
-						break;
-					}
-					p += 5;
-
-					filts[i].pgn = pgn;
-					filts[i].pgn_mask = ISOBUS_PGN_MASK;
-				}
+			if(poll(&pfd, 1, db_commit_timeout()) < 0 && errno != EINTR) {
+				perror("poll");
+				exit(EXIT_FAILURE);
 			}
-			if(!invalid) {
-				if(setsockopt(s[sock], SOL_CAN_ISOBUS, CAN_ISOBUS_FILTER, filts,
-							nfilts * sizeof(*filts)) < 0) {
-					perror("setsockopt");
+			if(pfd.revents & POLLIN) {
+				uint64_t val;
+				if(read(store_wake_fd, &val, sizeof(val)) < 0) {
+					perror("read (eventfd)");
 				}
-
-				ring_buffer_clear(buf);
 			}
-
-			free(filts);
-			break;
 		}
+		atomic_store(&store_sleeping, false);
+	}
 
-		case SEND_MESG:
-		{
-			int nchars;
-			char *p;
-			int pgn;
-			int len;
-			int dest;
-
-			sscanf(args, "%5x%2x%4x%n", &pgn, &dest, &len, &nchars);
-			p = args + nchars;
+	return NULL;
+}
 
-			int i;
-			unsigned char *data;
-			data = calloc(len, sizeof(*data));
-			for(i = 0; i < len; i++) {
-				sscanf(p, "%2hhx%n", &data[i], &nchars);
-				p += nchars;
-			}
+/* Function to hand messages to the storage thread, without ever waiting */
+static inline void store_func_push(struct mesg_rec *recs, int n)
+{
+	static bool full = false, behind = false;
+	unsigned long pushed, depth;
 
-			struct isobus_mesg mesg = { 0 };
-			mesg.pgn = pgn;
-			mesg.dlen = len;
-			for(i = 0; i < len; i++)
-				mesg.data[i] = data[i];
+	pushed = spsc_queue_push(&store_q, recs, n);
+	atomic_store(&store_offered_id, db_id);
 
-			struct sockaddr_can addr = { 0 };
-			addr.can_family = AF_CAN;
-			addr.can_addr.isobus.addr = dest;
+	/* Messages which do not fit are still sent live, but not stored */
+	if(pushed < (unsigned long)n) {
+		stats.store_dropped += n - pushed;
+		if(!full) {
+			fprintf(stderr, "Storage queue full, messages not stored\n");
+		}
+	}
+	full = pushed < (unsigned long)n;
 
-			sendto(s[sock], &mesg, sizeof(mesg), 0, (struct sockaddr *)&addr,
-					sizeof(addr));
+	depth = spsc_queue_depth(&store_q);
+	if(depth > stats.store_depth_max) {
+		stats.store_depth_max = depth;
+	}
+	if(depth >= store_hwm) {
+		if(!behind) {
+			stats.store_hwm_hits++;
+			fprintf(stderr, "Storage falling behind, %lu queued\n", depth);
+		}
+		behind = true;
+	} else if(depth < store_hwm / 2) {
+		behind = false;
+	}
+
+	/* Pairs with the storage thread checking the queue before sleeping */
+	atomic_thread_fence(memory_order_seq_cst);
+	if(atomic_load(&store_sleeping)) {
+		store_signal(store_wake_fd);
+	}
+}
+
+/* Function to find the first message still stored */
+static db_key_t retain_first(void)
+{
+	leveldb_iterator_t *iter;
+	db_key_t id;
+	char first[PGN_INDEX_ID_LEN];
+	const char *key;
+	size_t len;
+
+	if(db_use_log) {
+		id = seg_log_first_id(&db_log);
+		return id ? id : atomic_load(&store_committed_id);
+	}
+
+	iter = leveldb_create_iterator(db, db_scan_roptions);
+	pgn_index_put_id(first, LEVELDB_ID_KEY + 1);
+	leveldb_iter_seek(iter, first, sizeof(first));
+	id = atomic_load(&store_committed_id);
+	if(leveldb_iter_valid(iter)) {
+		key = leveldb_iter_key(iter, &len);
+		if(len == PGN_INDEX_ID_LEN) {
+			id = pgn_index_get_id(key);
+		}
+	}
+	leveldb_iter_destroy(iter);
+
+	return id;
+}
+
+/* Function to total the files storage is using */
+static unsigned long long retain_du(void)
+{
+	unsigned long long bytes = 0;
+	struct dirent *ent;
+	struct stat st;
+	DIR *dir;
+
+	if(!(dir = opendir(LEVELDB_PATH))) {
+		perror("opendir");
+		return 0;
+	}
+	while((ent = readdir(dir))) {
+		if(!fstatat(dirfd(dir), ent->d_name, &st, 0) && S_ISREG(st.st_mode)) {
+			bytes += st.st_size;
+		}
+	}
+	closedir(dir);
+
+	return bytes;
+}
+
+/* Function to estimate the bytes stored for messages from up to before to */
+static inline uint64_t retain_span(db_key_t from, db_key_t to)
+{
+	char from_key[PGN_INDEX_ID_LEN], to_key[PGN_INDEX_ID_LEN];
+	const char *start = from_key, *limit = to_key;
+	size_t len = PGN_INDEX_ID_LEN;
+	uint64_t size;
+
+	pgn_index_put_id(from_key, from);
+	pgn_index_put_id(to_key, to);
+	leveldb_approximate_sizes(db, 1, &start, &len, &limit, &len, &size);
+
+	return size;
+}
+
+/* Function to find the first message to keep, given storage's limits */
+static db_key_t retain_cutoff(db_key_t oldest, db_key_t newest)
+{
+	unsigned long long bytes, excess;
+	db_key_t cut = oldest, lo, hi, mid;
+
+	bytes = db_use_log ? seg_log_bytes(&db_log) : retain_du();
+	atomic_store(&retain_bytes, bytes);
+
+	/* The log can only drop whole segments */
+	if(db_use_log && retain_size && bytes > retain_size) {
+		cut = seg_log_cutoff(&db_log, retain_size);
+	}
+
+	/* Fewest of the oldest messages which take up the excess */
+	if(!db_use_log && retain_size && bytes > retain_size &&
+			retain_span(oldest, newest) > 0) {
+		excess = bytes - retain_size * RETAIN_LOW / 100;
+		lo = oldest;
+		hi = newest;
+		while(lo < hi) {
+			mid = lo + (hi - lo) / 2;
+			if(retain_span(oldest, mid) >= excess) {
+				hi = mid;
+			} else {
+				lo = mid + 1;
+			}
+		}
+		cut = lo;
+	}
+
+	/* Everything before the time index entry at or before the age limit */
+	if(retain_age) {
+		mid = time_index_start(&time_idx, time(NULL) - retain_age);
+		if(mid > cut) {
+			cut = mid;
+		}
+	}
+
+	return cut < newest ? cut : newest;
+}
+
+/* Function to delete the log segments before cut */
+static void retain_trim_log(db_key_t oldest, db_key_t cut)
+{
+	db_key_t first;
+
+	if(seg_log_trim(&db_log, cut) < 0) {
+		perror("seg_log_trim");
+	}
+
+	first = seg_log_first_id(&db_log);
+	if(first > oldest) {
+		if(time_index_trim(&time_idx, first) < 0) {
+			perror("time_index_trim");
+		}
+		atomic_store(&retain_oldest_id, first);
+		metrics_add(&stats.retain_mesgs, first - oldest);
+		printf("Deleted stored messages %llu to %llu\n",
+				(unsigned long long)oldest, (unsigned long long)first - 1);
+	}
+}
+
+/* Function to delete the messages before cut, and their index entries */
+static void retain_trim(db_key_t oldest, db_key_t cut)
+{
+	const char index_start[] = { PGN_INDEX_TAG },
+		  index_limit[] = { PGN_INDEX_TAG + 1 };
+	leveldb_writebatch_t *wb;
+	char *err = NULL;
+	char key[PGN_INDEX_ID_LEN], limit[PGN_INDEX_ID_LEN];
+	db_key_t id;
+	int n = 0;
+
+	wb = leveldb_writebatch_create();
+	for(id = oldest; id < cut; id++) {
+		pgn_index_put_id(key, id);
+		leveldb_writebatch_delete(wb, key, sizeof(key));
+		if(++n < RETAIN_BATCH && id + 1 < cut) {
+			continue;
+		}
+
+		leveldb_write(db, db_woptions, wb, &err);
+		leveldb_writebatch_clear(wb);
+		if(err) {
+			fprintf(stderr, "Leveldb delete error.\n");
+			leveldb_free(err);
+			break;
+		}
+		atomic_store(&retain_oldest_id, id + 1);
+		metrics_add(&stats.retain_mesgs, n);
+		n = 0;
+	}
+	leveldb_writebatch_destroy(wb);
+	if(id < cut) {
+		return;
+	}
+
+	if(pgn_index_trim(db, db_scan_roptions, db_woptions, cut, RETAIN_BATCH)
+			< 0) {
+		fprintf(stderr, "Leveldb index delete error.\n");
+	}
+	if(time_index_trim(&time_idx, cut) < 0) {
+		perror("time_index_trim");
+	}
+
+	/* Free the space now, rather than whenever LevelDB gets to it */
+	pgn_index_put_id(key, oldest);
+	pgn_index_put_id(limit, cut);
+	leveldb_compact_range(db, key, sizeof(key), limit, sizeof(limit));
+	leveldb_compact_range(db, index_start, sizeof(index_start), index_limit,
+			sizeof(index_limit));
+	printf("Deleted stored messages %llu to %llu\n",
+			(unsigned long long)oldest, (unsigned long long)cut - 1);
+}
+
+/* Function for the thread keeping storage within its limits */
+static void *retain_func(void *arg __attribute__ ((unused)))
+{
+	struct pollfd pfd = { .fd = retain_wake_fd, .events = POLLIN };
+	db_key_t oldest, cut;
+
+	atomic_store(&retain_oldest_id, retain_first());
+	while(!atomic_load(&retain_stop)) {
+		oldest = atomic_load(&retain_oldest_id);
+		cut = retain_cutoff(oldest, atomic_load(&store_committed_id));
+		if(cut > oldest && db_use_log) {
+			retain_trim_log(oldest, cut);
+		} else if(cut > oldest) {
+			retain_trim(oldest, cut);
+		}
+
+		if(poll(&pfd, 1, RETAIN_PERIOD * 1000) < 0 && errno != EINTR) {
+			perror("poll");
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+/* Buffers to receive a batch of messages into, one set per reading thread */
+struct recv_bufs {
+	struct isobus_mesg mes[RECV_BATCH_MAX];
+	struct sockaddr_can addr[RECV_BATCH_MAX];
+	struct iovec iov[RECV_BATCH_MAX];
+	char cmsgb[RECV_BATCH_MAX][CMSG_SPACE(sizeof(struct sockaddr_can)) +
+		CMSG_SPACE(sizeof(struct timeval))];
+	struct mmsghdr msgs[RECV_BATCH_MAX];
+};
+
+/* Function to receive up to max messages as records, all but their IDs */
+static inline int recv_mesgs(int sock, int iface, struct recv_bufs *b,
+		struct mesg_rec *recs, int max)
+{
+	int i, n;
+
+	/* Construct msghdrs to use to recevie messages from socket */
+	for(i = 0; i < max; i++) {
+		b->iov[i].iov_base = &b->mes[i];
+		b->iov[i].iov_len = sizeof(b->mes[i]);
+		b->msgs[i].msg_hdr.msg_name = &b->addr[i];
+		b->msgs[i].msg_hdr.msg_namelen = sizeof(b->addr[i]);
+		b->msgs[i].msg_hdr.msg_iov = &b->iov[i];
+		b->msgs[i].msg_hdr.msg_iovlen = 1;
+		b->msgs[i].msg_hdr.msg_control = b->cmsgb[i];
+		b->msgs[i].msg_hdr.msg_controllen = sizeof(b->cmsgb[i]);
+		b->msgs[i].msg_hdr.msg_flags = 0;
+	}
+
+	if((n = recvmmsg(sock, b->msgs, max, MSG_DONTWAIT, NULL)) <= 0) {
+		if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return 0;
+		}
+
+		return -1;
+	}
+
+	/* Fill in records for the whole batch in one pass */
+	for(i = 0; i < n; i++) {
+		/* Get daddr and approximate arrival time */
+		struct sockaddr_can daddr = { 0 };
+		struct timeval tv = { 0 };
+		struct cmsghdr *cmsg;
+		for(cmsg = CMSG_FIRSTHDR(&b->msgs[i].msg_hdr); cmsg != NULL;
+				cmsg = CMSG_NXTHDR(&b->msgs[i].msg_hdr, cmsg)) {
+			if(cmsg->cmsg_level == SOL_CAN_ISOBUS &&
+					cmsg->cmsg_type == CAN_ISOBUS_DADDR) {
+				memcpy(&daddr, CMSG_DATA(cmsg), sizeof(daddr));
+			} else if(cmsg->cmsg_level == SOL_SOCKET &&
+					cmsg->cmsg_type == SO_TIMESTAMP) {
+				memcpy(&tv, CMSG_DATA(cmsg), sizeof(tv));
+			}
+		}
+
+		recs[i].pgn = b->mes[i].pgn;
+		recs[i].tv_sec = tv.tv_sec;
+		recs[i].tv_usec = tv.tv_usec;
+		recs[i].iface = iface;
+		recs[i].daddr = daddr.can_addr.isobus.addr;
+		recs[i].saddr = b->addr[i].can_addr.isobus.addr;
+		recs[i].dlen = b->mes[i].dlen;
+		memcpy(recs[i].data, b->mes[i].data, sizeof(recs[i].data));
+	}
+
+	return n;
+}
+
+/* Function to handle incoming ISOBUS message(s) */
+static inline int read_func(int sock, int iface, struct ring_buffer *buf)
+{
+	static struct recv_bufs b;
+	struct mesg_rec *recs = ring_buffer_tail_address(buf);
+	int i, n;
+
+	/* Records go straight into the buffer */
+	if((n = recv_mesgs(sock, iface, &b, recs, recv_batch)) < 0) {
+		perror("recvmmsg");
+		exit(EXIT_FAILURE);
+	}
+	if(!n) {
+		return 0;
+	}
+	stats.rx_calls++;
+	stats.rx_mesgs += n;
+
+	for(i = 0; i < n; i++) {
+		recs[i].id = db_id + i;
+	}
+	db_id += n;
+	store_func_push(recs, n);
+	ring_buffer_tail_advance(buf, n * sizeof(*recs));
+
+	return n;
+}
+
+static inline unsigned long long tv_usecs(uint32_t sec, uint32_t usec)
+{
+	return sec * 1000000ULL + usec;
+}
+
+/* Function to wake the main thread, unless a wakeup is already pending */
+static inline void capture_signal(void)
+{
+	if(!atomic_exchange(&capture_pending, true)) {
+		store_signal(capture_wake_fd);
+	}
+}
+
+/* Function for the thread reading one interface */
+static void *capture_func(void *arg)
+{
+	struct capture *cap = arg;
+	struct pollfd pfds[2] = {
+		{ .fd = cap->sock, .events = POLLIN },
+		{ .fd = capture_stop_fd, .events = POLLIN },
+	};
+	struct mesg_rec recs[RECV_BATCH_MAX];
+	struct recv_bufs *b;
+	struct timeval now;
+	unsigned long room;
+	int n, max;
+
+	if(!(b = malloc(sizeof(*b)))) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	while(!atomic_load(&capture_stop)) {
+		/* Leave messages in the socket while the main thread catches up */
+		room = spsc_queue_free_elems(&cap->q);
+		max = room < (unsigned long)recv_batch ? (int)room : recv_batch;
+		if(!max) {
+			metrics_add(&cap->full, 1);
+			capture_signal();
+			poll(&pfds[1], 1, CAPTURE_RETRY);
+			continue;
+		}
+
+		gettimeofday(&now, NULL);
+		if((n = recv_mesgs(cap->sock, cap->iface, b, recs, max)) < 0) {
+			perror("recvmmsg");
+			exit(EXIT_FAILURE);
+		}
+		if(n) {
+			spsc_queue_push(&cap->q, recs, n);
+			metrics_add(&cap->calls, 1);
+		}
+
+		/* Anything not yet read arrived after the socket was found empty */
+		if(n < max) {
+			atomic_store(&cap->watermark, tv_usecs(now.tv_sec, now.tv_usec));
+		}
+		if(n) {
+			capture_signal();
+		}
+		if(n < max && poll(pfds, 2, -1) < 0 && errno != EINTR) {
+			perror("poll");
+			exit(EXIT_FAILURE);
+		}
+	}
+	free(b);
+
+	return NULL;
+}
+
+/* Function to start a capture thread for each interface */
+static int capture_start(int *s, int ns, const char *cpus)
+{
+	pthread_attr_t attr;
+	cpu_set_t set;
+	int i;
+
+	if(!(captures = calloc(ns, sizeof(*captures)))) {
+		return -1;
+	}
+	ncaptures = ns;
+	if((capture_wake_fd = eventfd(0, EFD_NONBLOCK)) < 0 ||
+			(capture_stop_fd = eventfd(0, 0)) < 0) {
+		return -1;
+	}
+
+	for(i = 0; i < ns; i++) {
+		struct capture *cap = &captures[i];
+
+		cap->sock = s[i];
+		cap->iface = i;
+		cap->cpu = -1;
+		if(cpus && *cpus) {
+			/* Comma separated, in interface order */
+			cap->cpu = strtol(cpus, (char **)&cpus, 10);
+			if(*cpus == ',') {
+				cpus++;
+			}
+		}
+		if(spsc_queue_create(&cap->q, CAPTURE_ORDER,
+					sizeof(struct mesg_rec)) < 0) {
+			return -1;
+		}
+
+		pthread_attr_init(&attr);
+		if(cap->cpu >= 0) {
+			CPU_ZERO(&set);
+			CPU_SET(cap->cpu, &set);
+			if((errno = pthread_attr_setaffinity_np(&attr, sizeof(set),
+							&set))) {
+				pthread_attr_destroy(&attr);
+				return -1;
+			}
+		}
+		errno = pthread_create(&cap->thread, &attr, capture_func, cap);
+		pthread_attr_destroy(&attr);
+		if(errno) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Everything isoblued keeps for each connected client */
+struct client {
+	struct reactor_handler h;
+	struct ring_buffer *buf;
+
+	/* Buffer for reassembling commands */
+	struct command_buf cmd;
+	/* Interface whose full transmit queue is holding up commands, or -1 */
+	int tx_wait;
+
+	/* Records encoded, but not yet sent */
+	char out[OUT_BUF_SIZE];
+	int out_head, out_tail;
+	/* Live messages before sent_mark_id are out once out_head reaches here */
+	int sent_mark;
+	db_key_t sent_mark_id;
+	/* When the oldest unsent record was encoded */
+	bool held;
+	struct timespec held_since;
+
+	/* Framing and position of the live stream */
+	enum stream_fmt fmt;
+	db_key_t next;
+	/* Live messages wanted from each interface, if not all */
+	struct mesg_filter *filts;
+	int nfilts;
+	bool filtering;
+
+	/* First live message not acknowledged, once the client ACKs at all */
+	bool acking;
+	db_key_t acked;
+	/* IDs of the live messages sent and not yet acknowledged, oldest first */
+	db_key_t *unacked;
+	int unacked_head, unacked_cnt;
+	bool window_shut;
+	/* Last message of a send being timed, when it went, and smoothed RTT */
+	bool rtt_timing;
+	db_key_t rtt_id;
+	struct timespec rtt_time;
+	unsigned long srtt_us;
+
+	/* Past data being sent, once stored up to past_ready */
+	bool replaying;
+	/* Whether the past data is live messages the buffer no longer has */
+	bool catching_up;
+	leveldb_iterator_t *db_iter;
+	struct seg_log_cursor log_cur;
+	/* Record of the log being sent, still in its mapped segment */
+	const struct seg_log_rec *log_rec;
+	bool past_pending;
+	db_key_t past_start, past_ready;
+	db_key_t db_stop;
+	/* Receive times of past data wanted, in seconds (end excluded) */
+	uint32_t past_tmin, past_tmax;
+	struct mesg_filter past_filt;
+	/* PGNs to look up in the PGN index, if few enough were asked for */
+	uint32_t past_pgn[PGN_INDEX_MAX];
+	int past_npgns;
+	struct pgn_index_cursor past_cur[PGN_INDEX_MAX];
+	/* Records read ahead from the iterator, and replay progress */
+	struct mesg_rec *past;
+	int past_head, past_tail;
+	bool past_done;
+	unsigned long past_cnt;
+	struct timespec past_time;
+};
+
+static struct client *clients;
+static int nclients = 0, max_clients = MAX_CLIENTS_DEF;
+static int send_delay = SEND_DELAY_DEF, send_size = SEND_SIZE_DEF;
+static int ack_window = ACK_WINDOW_DEF;
+
+/*
+ * First message in the ring buffer, and first one no client was sent (or for
+ * clients which ACK, had acknowledged)
+ */
+static db_key_t ring_first_id, ring_sent_id;
+
+/* Function to find the oldest message not yet overwritten in the buffer */
+static inline db_key_t ring_oldest(struct ring_buffer *buf)
+{
+	db_key_t slots = buf->count_bytes / sizeof(struct mesg_rec) - 1;
+
+	return db_id - ring_first_id > slots ? db_id - slots : ring_first_id;
+}
+
+/* Function to find the record of a message still in the buffer */
+static inline struct mesg_rec *ring_rec(struct ring_buffer *buf, db_key_t id)
+{
+	return ring_buffer_tail_rewind_address(buf,
+			(db_id - id) * sizeof(struct mesg_rec));
+}
+
+/* Function to move past messages overwritten before any client was sent them */
+static inline void ring_sent_catch_up(struct ring_buffer *buf)
+{
+	db_key_t oldest = ring_oldest(buf);
+
+	if(db_id - ring_sent_id > db_id - oldest) {
+		stats.ring_lost += oldest - ring_sent_id;
+		ring_sent_id = oldest;
+	}
+}
+
+/* Function to save where the buffer is, and what no client was sent yet */
+static void ring_checkpoint(struct ring_buffer *buf, int flags)
+{
+	ring_sent_catch_up(buf);
+	ring_buffer_seek_curs_tail_rewind(buf,
+			(db_id - ring_sent_id) * sizeof(struct mesg_rec));
+
+	if(ring_buffer_checkpoint(buf, flags) < 0) {
+		perror("ring_buffer_checkpoint");
+	}
+}
+
+/*
+ * Function to carry on with the messages the last run left in the buffer
+ *
+ * The saved offsets may be up to RING_CHECKPOINT behind, so records past the
+ * tail whose IDs follow on are taken back too. Checkpoints are only MS_ASYNC,
+ * so after a power loss they may also cover records which never reached
+ * disk; only the unbroken run of IDs before the tail is kept. The buffer is
+ * only kept if it reaches where storage ends; anything storage missed is
+ * queued again.
+ */
+static void ring_recover(struct ring_buffer *buf)
+{
+	db_key_t slots = buf->count_bytes / sizeof(struct mesg_rec) - 1;
+	db_key_t newest, from, unsent, n;
+	struct mesg_rec *r;
+
+	ring_first_id = ring_sent_id = db_id;
+
+	r = ring_buffer_tail_rewind_address(buf, sizeof(*r));
+	if(!buf->recovered || buf->tail_offset % sizeof(*r) ||
+			buf->curs_offset % sizeof(*r) || !r->id) {
+		ring_buffer_clear(buf);
+		return;
+	}
+	newest = r->id;
+	unsent = ring_buffer_unread_bytes(buf) / sizeof(*r);
+
+	/* Take back records written after the last checkpoint */
+	for(n = 0; n < slots; n++) {
+		r = ring_buffer_tail_address(buf);
+		if(r->id != newest + 1) {
+			break;
+		}
+		ring_buffer_tail_advance(buf, sizeof(*r));
+		newest++;
+		unsent++;
+	}
+
+	/* Find how far back the IDs run on without a break */
+	for(n = 1; n < slots; n++) {
+		r = ring_buffer_tail_rewind_address(buf, (n + 1) * sizeof(*r));
+		if(newest == n || r->id != newest - n) {
+			break;
+		}
+	}
+
+	if(newest + 1 < db_id) {
+		fprintf(stderr, "Buffer ends before storage does, not resuming it\n");
+		ring_buffer_clear(buf);
+		return;
+	}
+	if(newest >= db_id) {
+		from = newest - n + 1 > db_id ? newest - n + 1 : db_id;
+		db_id = newest + 1;
+		store_func_push(ring_rec(buf, from), db_id - from);
+		printf("Storing messages %llu to %llu from the buffer.\n",
+				(unsigned long long)from, (unsigned long long)newest);
+	}
+
+	ring_first_id = newest - n + 1;
+	ring_sent_id = db_id - (unsent < n ? unsent : n);
+	printf("Resuming buffer of messages %llu to %llu, %llu not yet sent.\n",
+			(unsigned long long)ring_first_id, (unsigned long long)newest,
+			(unsigned long long)(db_id - ring_sent_id));
+}
+
+/* Function to check if past data asked for has been stored */
+static inline bool past_ready(struct client *c)
+{
+	return c->past_pending && atomic_load(&store_committed_id) >= c->past_ready;
+}
+
+/* Function to check if any messages are waiting for a client */
+static inline bool check_send(struct client *c)
+{
+	return c->out_head != c->out_tail || c->next != db_id || c->replaying ||
+		past_ready(c);
+}
+
+/* Function to get room for len more bytes at the end of a client's buffer */
+static inline char *client_reserve(struct client *c, int len)
+{
+	if(OUT_BUF_SIZE - c->out_tail < len && c->out_head) {
+		memmove(c->out, c->out + c->out_head, c->out_tail - c->out_head);
+		c->out_tail -= c->out_head;
+		c->sent_mark = c->sent_mark > c->out_head ?
+			c->sent_mark - c->out_head : 0;
+		c->out_head = 0;
+	}
+
+	return OUT_BUF_SIZE - c->out_tail < len ? NULL : c->out + c->out_tail;
+}
+
+/* Function to stop any past data being sent to a client */
+static inline void past_stop(struct client *c)
+{
+	int i;
+
+	if(c->db_iter) {
+		leveldb_iter_destroy(c->db_iter);
+		c->db_iter = NULL;
+	}
+	seg_log_cursor_close(&c->log_cur);
+	for(i = 0; i < c->past_npgns; i++) {
+		pgn_index_cursor_close(&c->past_cur[i]);
+	}
+	c->past_pending = false;
+	c->replaying = false;
+	c->catching_up = false;
+}
+
+/* Function to start sending past data, once it has all been stored */
+static inline void past_start(struct client *c)
+{
+	db_key_t start;
+	char key[PGN_INDEX_ID_LEN];
+	int i;
+
+	/* The next ID is stored under key 0, so never start there */
+	start = c->past_start > LEVELDB_ID_KEY ? c->past_start : LEVELDB_ID_KEY + 1;
+
+	c->past_pending = false;
+	c->replaying = true;
+	if(db_use_log) {
+		seg_log_seek(&db_log, &c->log_cur, start);
+	} else {
+		c->db_iter = leveldb_create_iterator(db, db_scan_roptions);
+		pgn_index_put_id(key, start);
+		leveldb_iter_seek(c->db_iter, key, sizeof(key));
+	}
+	for(i = 0; i < c->past_npgns; i++) {
+		pgn_index_cursor_open(&c->past_cur[i], db, db_scan_roptions,
+				c->past_pgn[i], start);
+	}
+	c->past_head = c->past_tail = 0;
+	c->past_done = false;
+	c->past_cnt = 0;
+	clock_gettime(CLOCK_MONOTONIC, &c->past_time);
+}
+
+/* Function to check if a stored message was asked for */
+static inline bool past_match(struct client *c, const struct mesg_rec *r)
+{
+	return r->tv_sec >= c->past_tmin && r->tv_sec < c->past_tmax &&
+		mesg_filter_match(&c->past_filt, r->pgn, r->saddr, r->daddr);
+}
+
+/* Function to add a PGN to look up, once, so it is not sent twice */
+static inline void past_index_pgn(struct client *c, uint32_t pgn)
+{
+	int i;
+
+	for(i = 0; i < c->past_npgns; i++) {
+		if(c->past_pgn[i] == pgn) {
+			return;
+		}
+	}
+	c->past_pgn[c->past_npgns++] = pgn;
+}
+
+/*
+ * Function to parse a filter, as set for the live stream or optionally ending
+ * a past data command (then give past, to look its PGNs up in the index)
+ */
+static inline int parse_filter(const char *p, size_t len,
+		struct mesg_filter *filt, struct client *past)
+{
+	uint32_t pgns[PGN_INDEX_MAX];
+	int n, i;
+
+	if(past) {
+		past->past_npgns = 0;
+	}
+	if((n = command_parse_filter(p, len, filt, pgns, PGN_INDEX_MAX)) < 0) {
+		return -1;
+	}
+	/* Only LevelDB has a PGN index */
+	for(i = 0; past && !db_use_log && i < n; i++) {
+		past_index_pgn(past, pgns[i] & ISOBUS_PGN_MASK);
+	}
+
+	return 0;
+}
+
+/* Function to ask for past data, once everything up to now is stored */
+static inline void past_request(struct client *c)
+{
+	c->past_pending = true;
+	c->past_ready = db_id;
+	atomic_store(&store_flush, true);
+	store_signal(store_wake_fd);
+}
+
+/* Function to note a live message was sent to a client, to be acknowledged */
+static inline void window_add(struct client *c, db_key_t id)
+{
+	if(c->acking) {
+		c->unacked[(c->unacked_head + c->unacked_cnt++) % ack_window] = id;
+	}
+}
+
+/* Function to check if a client wants a live message */
+static inline bool client_match(struct client *c, const struct mesg_rec *r)
+{
+	return !c->filtering || r->iface >= c->nfilts ||
+		mesg_filter_match(&c->filts[r->iface], r->pgn, r->saddr, r->daddr);
+}
+
+/*
+ * Function to send a client the live messages it missed from storage, up to
+ * where the buffer is now, before going on with the buffer
+ */
+static inline void catch_up(struct client *c)
+{
+	mesg_filter_clear(&c->past_filt);
+	c->past_npgns = 0;
+	c->past_tmin = 0;
+	c->past_tmax = UINT32_MAX;
+	c->past_start = c->next;
+	c->db_stop = db_id;
+	c->catching_up = true;
+	past_request(c);
+	stats.client_catch_ups++;
+}
+
+/* Function to check if a client may be sent more live messages before it ACKs */
+static inline bool window_open(struct client *c)
+{
+	return !c->acking || c->unacked_cnt < ack_window;
+}
+
+/* Function to decode the next batch of past data found in the PGN index */
+static inline void past_prefetch_index(struct client *c)
+{
+	while(c->past_tail < REPLAY_PREFETCH) {
+		const char *key, *val;
+		char seek[PGN_INDEX_ID_LEN];
+		db_key_t id;
+		size_t len;
+		int i, next;
+
+		/* Merge the ID lists of every PGN asked for */
+		id = PGN_INDEX_END;
+		next = 0;
+		for(i = 0; i < c->past_npgns; i++) {
+			if(pgn_index_cursor_id(&c->past_cur[i]) < id) {
+				id = pgn_index_cursor_id(&c->past_cur[i]);
+				next = i;
+			}
+		}
+		if(id >= c->db_stop) {
+			c->past_done = true;
+			break;
+		}
+		pgn_index_cursor_next(&c->past_cur[next]);
+
+		pgn_index_put_id(seek, id);
+		leveldb_iter_seek(c->db_iter, seek, sizeof(seek));
+		if(!leveldb_iter_valid(c->db_iter)) {
+			continue;
+		}
+		key = leveldb_iter_key(c->db_iter, &len);
+		if(len != sizeof(seek) || memcmp(key, seek, sizeof(seek))) {
+			continue;
+		}
+
+		val = leveldb_iter_value(c->db_iter, &len);
+		if(parse_mesg(val, len, &c->past[c->past_tail])) {
+			c->past[c->past_tail].id = id;
+			if(past_match(c, &c->past[c->past_tail])) {
+				c->past_tail++;
+			}
+		}
+	}
+}
+
+/* Function to decode the next batch of past data, ahead of encoding it */
+static inline void past_prefetch(struct client *c)
+{
+	c->past_head = c->past_tail = 0;
+
+	if(c->past_npgns) {
+		past_prefetch_index(c);
+		return;
+	}
+
+	while(c->past_tail < REPLAY_PREFETCH) {
+		const char *key, *val;
+		db_key_t id;
+		size_t len;
+
+		/* Index entries come after every message */
+		if(!leveldb_iter_valid(c->db_iter)) {
+			c->past_done = true;
+			break;
+		}
+		key = leveldb_iter_key(c->db_iter, &len);
+		if(len != PGN_INDEX_ID_LEN || (id = pgn_index_get_id(key)) >=
+				c->db_stop) {
+			c->past_done = true;
+			break;
+		}
+
+		val = leveldb_iter_value(c->db_iter, &len);
+		if(parse_mesg(val, len, &c->past[c->past_tail])) {
+			c->past[c->past_tail].id = id;
+			if(past_match(c, &c->past[c->past_tail])) {
+				c->past_tail++;
+			}
+		}
+
+		leveldb_iter_next(c->db_iter);
+	}
+}
+
+/*
+ * Function to find the next past record to send, or NULL once there are none
+ *
+ * Records in the log are encoded where they are mapped, as the cursor holds
+ * their segment until past_next moves it on.
+ */
+static inline const struct mesg_rec *past_peek(struct client *c)
+{
+	const struct seg_log_rec *rec;
+
+	if(!db_use_log) {
+		while(c->past_head == c->past_tail && !c->past_done) {
+			past_prefetch(c);
+		}
+		return c->past_head < c->past_tail ? &c->past[c->past_head] : NULL;
+	}
+
+	while(!c->past_done) {
+		if(!(rec = seg_log_get(&c->log_cur)) || rec->id >= c->db_stop) {
+			c->past_done = true;
+			break;
+		}
+		if(rec->len == sizeof(struct mesg_rec) &&
+				past_match(c, (const struct mesg_rec *)rec->data)) {
+			c->log_rec = rec;
+			return (const struct mesg_rec *)rec->data;
+		}
+		seg_log_next(&c->log_cur, rec);
+	}
+
+	return NULL;
+}
+
+/* Function to move past the record past_peek found */
+static inline void past_next(struct client *c)
+{
+	if(db_use_log) {
+		seg_log_next(&c->log_cur, c->log_rec);
+	} else {
+		c->past_head++;
+	}
+}
+
+/* Function to queue up past data for a client, as far as end */
+static inline char *past_func(struct client *c, char *cp, char *end)
+{
+	const struct mesg_rec *r;
+
+	while(cp <= end) {
+		if(c->catching_up && !window_open(c)) {
+			break;
+		}
+		if((r = past_peek(c))) {
+			/* Caught up messages carry on the live stream, gaps and all */
+			if(c->catching_up) {
+				if(r->id != c->next) {
+					cp = encode_gap(cp, c->fmt, c->next, r->id - 1);
+				}
+				c->next = r->id + 1;
+				if(client_match(c, r)) {
+					cp = encode_mesg(cp, c->fmt, MESG, r);
+					window_add(c, r->id);
+				}
+			} else {
+				cp = encode_mesg(cp, c->fmt, OLD_MESG, r);
+			}
+			past_next(c);
+			c->past_cnt++;
+			continue;
+		}
+
+		/* Past data is done */
+		long us = us_since(&c->past_time);
+		printf("Replayed %lu records in %.3f s (%.0f records/s)\n",
+				c->past_cnt, us / 1e6, us ? c->past_cnt * 1e6 / us : 0.0);
+		stats.replay_recs += c->past_cnt;
+		stats.replay_us += us;
+
+		/* Go back to the buffer where storage stopped */
+		if(c->catching_up) {
+			if(c->next != c->db_stop) {
+				cp = encode_gap(cp, c->fmt, c->next, c->db_stop - 1);
+				c->next = c->db_stop;
+			}
+			past_stop(c);
+			break;
+		}
+		past_stop(c);
+
+		if(c->fmt == FMT_BIN) {
+			struct mesg_rec r = { 0 };
+			cp = bin_mesg(cp, OLD_MESG, &r);
+			r.iface = 1;
+			cp = bin_mesg(cp, OLD_MESG, &r);
+			break;
+		}
+		*(cp++) = OLD_MESG;
+		*(cp++) = '0';
+		*(cp++) = '0';
+		*(cp++) = '0';
+		*(cp++) = '0';
+		*(cp++) = '0';
+		*(cp++) = '0';
+		*(cp++) = '0';
+		*(cp++) = '0';
+		*(cp++) = '0';
+		*(cp++) = '\n';
+		*(cp++) = OLD_MESG;
+		*(cp++) = '1';
+		*(cp++) = '0';
+		*(cp++) = '0';
+		*(cp++) = '0';
+		*(cp++) = '0';
+		*(cp++) = '0';
+		*(cp++) = '0';
+		*(cp++) = '0';
+		*(cp++) = '0';
+		*(cp++) = '\n';
+		break;
+	}
+
+	return cp;
+}
+
+/*
+ * Function to widen an ID from a client, who has only its low 32 bits, to the
+ * one nearest the next ID
+ */
+static inline db_key_t client_id(uint32_t id)
+{
+	return db_id + (int32_t)(id - (uint32_t)db_id);
+}
+
+/* Function to take a client's acknowledgement of every message up to id */
+static inline void ack_func(struct client *c, db_key_t id)
+{
+	db_key_t acked = id + 1;
+
+	/* Only acknowledgements of what was sent and not yet acknowledged count */
+	if(acked - c->acked > c->next - c->acked) {
+		stats.ack_stale++;
+		return;
+	}
+
+	c->acking = true;
+	c->acked = acked;
+	stats.acks++;
+	while(c->unacked_cnt && c->unacked[c->unacked_head] < acked) {
+		c->unacked_head = (c->unacked_head + 1) % ack_window;
+		c->unacked_cnt--;
+	}
+	if(c->acked > ring_sent_id) {
+		ring_sent_id = c->acked;
+	}
+
+	/* Smooth the round trip time as TCP does, by 1/8 */
+	if(c->rtt_timing && c->acked > c->rtt_id) {
+		unsigned long us = us_since(&c->rtt_time);
+
+		c->srtt_us = c->srtt_us ? c->srtt_us - c->srtt_us / 8 + us / 8 : us;
+		metrics_hist_add(&stats.ack_rtt_hist, us);
+		c->rtt_timing = false;
+	}
+}
+
+/* Function to encode buffered messages for a client, as its buffer allows */
+static inline void fill_func(struct client *c)
+{
+	char *cp, *end;
+
+	if(!client_reserve(c, OUT_BUF_SIZE / 2)) {
+		return;
+	}
+	cp = c->out + c->out_tail;
+	/* Leave room for a command response */
+	end = c->out + OUT_BUF_SIZE - 2 * HEX_MESG_MAX;
+
+	/*
+	 * Live messages already overwritten are sent from storage instead, unless
+	 * past data asked for is in the way; then they are skipped, saying so
+	 */
+	db_key_t oldest = ring_oldest(c->buf);
+	if(!c->catching_up && db_id - c->next > db_id - oldest) {
+		if(c->replaying || c->past_pending) {
+			cp = encode_gap(cp, c->fmt, c->next, oldest - 1);
+			stats.client_skipped += oldest - c->next;
+			stats.client_gaps++;
+			c->next = oldest;
+		} else {
+			catch_up(c);
+		}
+	}
+
+	if(!c->catching_up) {
+		struct mesg_rec *r = ring_rec(c->buf, c->next);
+		while(c->next != db_id && cp <= end && window_open(c)) {
+			if(client_match(c, r)) {
+				cp = encode_mesg(cp, c->fmt, MESG, r);
+				window_add(c, c->next);
+			}
+			r++;
+			c->next++;
+		}
+		/* Nothing waiting to be acknowledged means it all was, once sent */
+		if(!c->unacked_cnt) {
+			c->sent_mark = cp - c->out;
+			c->sent_mark_id = c->next;
+		}
+	}
+
+	/* Count each time the window stops messages which are waiting */
+	if(!window_open(c) && (c->next != db_id || c->catching_up)) {
+		if(!c->window_shut) {
+			c->window_shut = true;
+			stats.ack_window_full++;
+		}
+	} else {
+		c->window_shut = false;
+	}
+
+	/* Start past data once everything before the request is stored */
+	if(past_ready(c)) {
+		past_start(c);
+	}
+
+	/* Fill the rest of the buffer with past data */
+	if(c->replaying) {
+		cp = past_func(c, cp, end);
+	}
+
+	c->out_tail = cp - c->out;
+}
+
+/* Function to note the live messages a client's sends have taken out */
+static inline void sent_check(struct client *c)
+{
+	if(c->out_head >= c->sent_mark && c->sent_mark_id > ring_sent_id) {
+		ring_sent_id = c->sent_mark_id;
+	}
+}
+
+/* Function to send what fits of a client's buffered messages */
+static inline int send_out(struct client *c)
+{
+	int sent;
+
+	fill_func(c);
+	if(c->out_head == c->out_tail) {
+		sent_check(c);
+		return 0;
+	}
+
+	if(c->out_tail - c->out_head >= send_size) {
+		stats.tx_full++;
+	}
+	if((sent = send(c->h.fd, c->out + c->out_head, c->out_tail - c->out_head,
+				MSG_DONTWAIT)) < 0) {
+		perror("send");
+
+		switch(errno) {
+		case EAGAIN:
+			return 0;
+
+		default:
+			return -1;
+		}
+	}
+
+	stats.tx_sends++;
+	stats.tx_bytes += sent;
+	if(sent > stats.tx_max) {
+		stats.tx_max = sent;
+	}
+	unsigned long long held = us_since(&c->held_since);
+	stats.tx_held_us += held;
+	metrics_hist_add(&stats.tx_held_hist, held);
+	if(held > stats.tx_held_max_us) {
+		stats.tx_held_max_us = held;
+	}
+
+	c->out_head += sent;
+	sent_check(c);
+	if(c->out_head == c->out_tail) {
+		c->out_head = c->out_tail = c->sent_mark = 0;
+		c->held = false;
+
+		/* Everything before next is out, so time until it is acknowledged */
+		if(c->acking && !c->rtt_timing && c->unacked_cnt) {
+			c->rtt_timing = true;
+			c->rtt_id = c->unacked[(c->unacked_head + c->unacked_cnt - 1) %
+					ack_window];
+			clock_gettime(CLOCK_MONOTONIC, &c->rtt_time);
+		}
+	}
+
+	return 1;
+}
+
+/* Function to send buffered messages to a client */
+static inline int send_func(struct client *c)
+{
+	int i, ret;
+
+	/* While replaying, keep refilling until the socket stops taking it all */
+	for(i = 0; i < REPLAY_BURST; i++) {
+		if((ret = send_out(c)) <= 0 || !c->replaying ||
+				c->out_head != c->out_tail) {
+			return ret;
+		}
+	}
+
+	return 1;
+}
+
+/*
+ * Function to decide if a client should be sent to now
+ *
+ * Records are held until send_size bytes are waiting, or the oldest has
+ * waited send_delay, whichever comes first. Otherwise the timeout (in ms) is
+ * lowered to when the oldest will have waited long enough.
+ */
+static inline bool send_due(struct client *c, int *timeout)
+{
+	long wait;
+	int ms;
+
+	if(check_send(c)) {
+		fill_func(c);
+	}
+	if(c->out_head == c->out_tail) {
+		return false;
+	}
+	if(!c->held) {
+		c->held = true;
+		clock_gettime(CLOCK_MONOTONIC, &c->held_since);
+	}
+
+	/* Past data is sent as fast as it is read */
+	if(c->out_tail - c->out_head >= send_size || c->replaying) {
+		return true;
+	}
+	if((wait = send_delay - us_since(&c->held_since)) <= 0) {
+		return true;
+	}
+
+	ms = (wait + 999) / 1000;
+	if(*timeout < 0 || ms < *timeout) {
+		*timeout = ms;
+	}
+
+	return false;
+}
+
+/* Messages from clients waiting to go out on one interface */
+struct tx_queue {
+	/* The interface's socket */
+	struct reactor_handler *h;
+	struct isobus_mesg mesg[TX_QUEUE];
+	struct sockaddr_can addr[TX_QUEUE];
+	unsigned int head, tail;
+	/* The interface was out of buffers, so try again after TX_RETRY */
+	bool backoff;
+};
+
+static struct tx_queue *txqs;
+static int ntxqs;
+
+/* Function to queue a message from a client, false if the queue is full */
+static inline bool tx_queue(struct tx_queue *q, const struct command_send *send)
+{
+	unsigned int i = q->tail & (TX_QUEUE - 1);
+
+	if(q->tail - q->head == TX_QUEUE) {
+		return false;
+	}
+
+	memset(&q->mesg[i], 0, sizeof(q->mesg[i]));
+	q->mesg[i].pgn = send->pgn;
+	q->mesg[i].dlen = send->dlen;
+	memcpy(q->mesg[i].data, send->data, send->dlen);
+
+	memset(&q->addr[i], 0, sizeof(q->addr[i]));
+	q->addr[i].can_family = AF_CAN;
+	q->addr[i].can_addr.isobus.addr = send->daddr;
+
+	q->tail++;
+	stats.bus_queued++;
+
+	return true;
+}
+
+/*
+ * Function to send as much of an interface's queue as it will take
+ *
+ * Waits to be writable when the socket is full, or retries after TX_RETRY
+ * when the interface is out of buffers (which epoll does not report). A
+ * message the interface refuses outright is counted as failed and dropped.
+ */
+static void tx_flush(struct reactor *reactor, struct tx_queue *q)
+{
+	static struct mmsghdr msgs[TX_QUEUE];
+	static struct iovec iov[TX_QUEUE];
+	unsigned int i, n;
+	int sent;
+
+	q->backoff = false;
+	while(q->head != q->tail) {
+		n = q->tail - q->head;
+		for(i = 0; i < n; i++) {
+			unsigned int j = (q->head + i) & (TX_QUEUE - 1);
+
+			iov[i].iov_base = &q->mesg[j];
+			iov[i].iov_len = sizeof(q->mesg[j]);
+			memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+			msgs[i].msg_hdr.msg_name = &q->addr[j];
+			msgs[i].msg_hdr.msg_namelen = sizeof(q->addr[j]);
+			msgs[i].msg_hdr.msg_iov = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		stats.bus_calls++;
+		if((sent = sendmmsg(q->h->fd, msgs, n, MSG_DONTWAIT)) < 0) {
+			if(errno == EAGAIN || errno == EWOULDBLOCK) {
+				break;
+			}
+			if(errno == ENOBUFS) {
+				q->backoff = true;
+				break;
+			}
+
+			perror("sendmmsg");
+			stats.bus_failed++;
+			q->head++;
+			continue;
+		}
+
+		stats.bus_sent += sent;
+		q->head += sent;
+	}
+
+	reactor_want_write(reactor, q->h, q->head != q->tail && !q->backoff);
+}
+
+/* Function to handle the commands a client has sent, until one is held up */
+static void command_run(struct reactor *reactor, struct client *c)
+{
+	char *cmd;
+	size_t len;
+
+	/* Handle every whole command received, where it lies in the buffer */
+	while((cmd = command_buf_next(&c->cmd, &len))) {
+		char op;
+		int sock;
+		char *args;
+		size_t alen;
+
+		op = cmd[0];
+		sock = len > 1 ? hex_nib_table[(uint8_t)cmd[1]] : -1;
+		args = cmd + (len > 2 ? 2 : len);
+		alen = cmd + len - args;
+
+		/* Acknowledgements are too frequent to print */
+		if(op != ACK) {
+			printf("Received command %c %s\n", op, args);
+		}
+
+		switch(op) {
+		case START:
+		{
+			char *cp, *sp;
+			uint32_t acked;
+
+			/* Reset iterator */
+			past_stop(c);
+
+			/* Select framing, hex unless binary is asked for */
+			c->fmt = alen > 0 && alen != 8 && args[0] == 'b' ?
+					FMT_BIN : FMT_HEX;
+			if(c->fmt == FMT_BIN) {
+				args++;
+				alen--;
+			}
+
+			/*
+			 * Resume after the last message the client has, if it says, from
+			 * storage as need be; otherwise skip buffered messages
+			 */
+			if(alen == 8 && hex_get(args, 8, &acked) == 0 &&
+					client_id(acked) < db_id) {
+				c->next = client_id(acked) + 1;
+			} else {
+				c->next = db_id;
+			}
+			c->acking = false;
+			c->acked = c->next;
+			c->unacked_head = c->unacked_cnt = 0;
+			c->rtt_timing = false;
+
+			/* Repsond with current ID */
+			if(!(sp = cp = client_reserve(c, HEX_MESG_MAX))) {
+				fprintf(stderr, "No room to respond to start command\n");
+				break;
+			}
+			if(c->fmt == FMT_BIN) {
+				struct mesg_rec r = { 0 };
+				r.iface = 0xf;
+				r.id = db_id;
+				cp = bin_mesg(cp, START, &r);
+				c->out_tail += cp-sp;
+				break;
+			}
+			*(cp++) = START;
+			*(cp++) = 'f';
+			cp = hex_val(cp, db_id, 8);
+			*(cp++) = '\n';
+			c->out_tail += cp-sp;
+
+			break;
+		}
+		case ACK:
+		{
+			uint32_t id;
+
+			if(alen != 8 || hex_get(args, 8, &id) < 0) {
+				fprintf(stderr, "Invalid acknowledgement\n");
+				break;
+			}
+			ack_func(c, client_id(id));
+
+			break;
+		}
+		case GET_PAST:
+		{
+			uint32_t start, stop;
+
+			past_stop(c);
+			if(command_parse_range(args, alen, &start, &stop) < 0 ||
+					parse_filter(args + 16, alen - 16, &c->past_filt, c) < 0) {
+				fprintf(stderr, "Invalid past data command\n");
+				break;
+			}
+
+			/*
+			 * 0 and ffffffff still mean from the first and to the last;
+			 * otherwise stop is the last wanted, as in gap records
+			 */
+			c->past_start = start ? client_id(start) : 0;
+			c->db_stop = stop != UINT32_MAX ? client_id(stop) + 1 : db_id;
+			if(c->db_stop > db_id) {
+				c->db_stop = db_id;
+			}
+			c->past_tmin = 0;
+			c->past_tmax = UINT32_MAX;
+			past_request(c);
+
+			break;
+		}
+		case GET_TIME:
+		{
+			uint32_t tmin, tmax;
+
+			past_stop(c);
+			if(command_parse_range(args, alen, &tmin, &tmax) < 0 ||
+					parse_filter(args + 16, alen - 16, &c->past_filt, c) < 0) {
+				fprintf(stderr, "Invalid time range command\n");
+				break;
+			}
+
+			/* Only scan the keys the time index says could be in range */
+			c->past_start = time_index_start(&time_idx, tmin);
+			c->db_stop = time_index_stop(&time_idx, tmax, db_id);
+			c->past_tmin = tmin;
+			c->past_tmax = tmax;
+			past_request(c);
+
+			break;
+		}
+		case SET_FILTERS:
+		{
+			static struct mesg_filter filt;
+			int i;
+
+			if(sock < 0 || sock >= ntxqs ||
+					parse_filter(args, alen, &filt, NULL) < 0) {
+				fprintf(stderr, "Invalid filter command\n");
+				break;
+			}
+
+			/*
+			 * Only this client's view of the interface changes, from the next
+			 * message it is sent; everything is still received and stored
+			 */
+			c->filts[sock] = filt;
+			c->filtering = false;
+			for(i = 0; i < ntxqs; i++) {
+				c->filtering |= !mesg_filter_all(&c->filts[i]);
+			}
+
+			break;
+		}
+
+		case SEND_MESG:
+		{
+			struct command_send send;
+
+			if(sock < 0 || sock >= ntxqs ||
+					command_parse_send(args, alen, &send) < 0) {
+				fprintf(stderr, "Invalid send command\n");
+				break;
+			}
+
+			/* Hold the client back until the interface catches up */
+			if(!tx_queue(&txqs[sock], &send)) {
+				tx_flush(reactor, &txqs[sock]);
+				if(!tx_queue(&txqs[sock], &send)) {
+					command_buf_unget(&c->cmd, cmd, len);
+					c->tx_wait = sock;
+					reactor_want_read(reactor, &c->h, false);
+					stats.bus_held++;
+					return;
+				}
+			}
+
+			break;
+		}
+		}
+	}
+}
+
+/* Function to handle commands from a client */
+static inline int command_func(struct reactor *reactor, struct client *c)
+{
+	char *space;
+	size_t room;
+
+	int chars;
+	room = command_buf_space(&c->cmd, &space);
+	chars = recv(c->h.fd, space, room, MSG_DONTWAIT);
+	if(chars < 0) {
+		perror("read");
+		return -1;
+	} else if(chars == 0) {
+		/* Client hung up */
+		return -1;
+	}
+	command_buf_fill(&c->cmd, chars);
+	if(c->cmd.dropped) {
+		fprintf(stderr, "Command too long, dropped\n");
+		c->cmd.dropped = 0;
+	}
+
+	command_run(reactor, c);
+
+	return 0;
+}
+
+/* Function to send what clients queued, and let held up clients carry on */
+static void tx_func(struct reactor *reactor, int *timeout)
+{
+	bool resumed = false;
+	int i;
+
+	for(i = 0; i < ntxqs; i++) {
+		tx_flush(reactor, &txqs[i]);
+	}
+
+	for(i = 0; i < max_clients; i++) {
+		struct client *c = &clients[i];
+
+		if(c->h.fd < 0 || c->tx_wait < 0 ||
+				txqs[c->tx_wait].tail - txqs[c->tx_wait].head == TX_QUEUE) {
+			continue;
+		}
+
+		c->tx_wait = -1;
+		reactor_want_read(reactor, &c->h, true);
+		command_run(reactor, c);
+		resumed = true;
+	}
+
+	for(i = 0; i < ntxqs; i++) {
+		if(resumed) {
+			tx_flush(reactor, &txqs[i]);
+		}
+		if(txqs[i].backoff && *timeout > TX_RETRY) {
+			*timeout = TX_RETRY;
+		}
+	}
+}
+
+/* Event handlers for each type of file descriptor */
+struct can_handler {
+	struct reactor_handler h;
+	int iface;
+	struct ring_buffer *buf;
+	const char *name;
+	/* Messages received, and as of the last metrics written */
+	unsigned long long mesgs, mesgs_last;
+	/* Whether an error was reported while a capture thread reads it */
+	bool error;
+};
+
+static struct can_handler *cans;
+
+static bool done = false;
+
+static int can_read(struct reactor *reactor __attribute__ ((unused)),
+		struct reactor_handler *h)
+{
+	struct can_handler *can = container_of(h, struct can_handler, h);
+	int n;
+
+	n = read_func(h->fd, can->iface, can->buf);
+	can->mesgs += n;
+
+	return n;
+}
+
+static void can_close(struct reactor *reactor __attribute__ ((unused)),
+		struct reactor_handler *h __attribute__ ((unused)))
+{
+	/* Can not continue without storing messages */
+	done = true;
+}
+
+static int can_write(struct reactor *reactor, struct reactor_handler *h)
+{
+	struct can_handler *can = container_of(h, struct can_handler, h);
+
+	tx_flush(reactor, &txqs[can->iface]);
+
+	return 0;
+}
+
+static const struct reactor_ops can_ops = {
+	can_read,
+	can_write,
+	can_close,
+};
+
+/*
+ * Function for epoll reporting an error on a socket a capture thread reads
+ *
+ * Errors are reported even when not reading, but the thread reads the socket
+ * (and so gets the error) itself; reading it here too would race with it.
+ */
+static int can_error(struct reactor *reactor __attribute__ ((unused)),
+		struct reactor_handler *h)
+{
+	struct can_handler *can = container_of(h, struct can_handler, h);
+
+	if(!can->error) {
+		can->error = true;
+		fprintf(stderr, "Error on %s, left to its capture thread\n",
+				can->name);
+	}
+
+	return 0;
+}
+
+static const struct reactor_ops capture_can_ops = {
+	can_error,
+	can_write,
+	can_close,
+};
+
+/*
+ * Function to merge the capture queues into the buffer, oldest first
+ *
+ * A message waits while an interface with nothing queued could still have
+ * an older one: until that interface's thread has found its socket empty
+ * since, or merge_delay has passed. Lowers *timeout to when the first
+ * waiting message is due, and returns the number merged.
+ */
+static int merge_func(struct ring_buffer *buf, int *timeout)
+{
+	struct mesg_rec *recs = ring_buffer_tail_address(buf);
+	struct mesg_rec *heads[ncaptures];
+	unsigned long counts[ncaptures], taken[ncaptures];
+	unsigned long long marks[ncaptures], calls, ts, due;
+	struct timeval now;
+	int i, j, next, n = 0;
+
+	atomic_store(&capture_pending, false);
+	gettimeofday(&now, NULL);
+	due = tv_usecs(now.tv_sec, now.tv_usec) - merge_delay;
+
+	/* Marks first, so every message before them is seen queued */
+	for(i = 0; i < ncaptures; i++) {
+		marks[i] = atomic_load(&captures[i].watermark);
+		counts[i] = spsc_queue_peek(&captures[i].q, (void **)&heads[i]);
+		taken[i] = 0;
+	}
+
+	while(n < MERGE_BATCH) {
+		/* Oldest queued message, the lowest interface first on a tie */
+		next = -1;
+		for(i = 0; i < ncaptures; i++) {
+			if(counts[i] && (next < 0 || tv_usecs(heads[i]->tv_sec,
+							heads[i]->tv_usec) < ts)) {
+				next = i;
+				ts = tv_usecs(heads[i]->tv_sec, heads[i]->tv_usec);
+			}
+		}
+		if(next < 0) {
+			break;
+		}
+
+		for(j = 0; j < ncaptures; j++) {
+			if(!counts[j] && ts > marks[j] && ts > due) {
+				break;
+			}
+		}
+		if(j < ncaptures) {
+			stats.merge_held++;
+			if((ts - due) / 1000 + 1 < (unsigned long long)*timeout) {
+				*timeout = (ts - due) / 1000 + 1;
+			}
+			break;
+		}
+
+		recs[n] = *heads[next];
+		recs[n].id = db_id + n;
+		cans[next].mesgs++;
+		n++;
+		heads[next]++;
+		taken[next]++;
+
+		/* Pick up where a queue wraps, or what came in since */
+		if(!--counts[next]) {
+			spsc_queue_pop(&captures[next].q, taken[next]);
+			taken[next] = 0;
+			marks[next] = atomic_load(&captures[next].watermark);
+			counts[next] = spsc_queue_peek(&captures[next].q,
+					(void **)&heads[next]);
+		}
+	}
+
+	for(i = 0; i < ncaptures; i++) {
+		spsc_queue_pop(&captures[i].q, taken[i]);
+		calls = metrics_get(&captures[i].calls);
+		stats.rx_calls += calls - captures[i].calls_seen;
+		captures[i].calls_seen = calls;
+	}
+	if(!n) {
+		return 0;
+	}
+	stats.rx_mesgs += n;
+
+	db_id += n;
+	store_func_push(recs, n);
+	ring_buffer_tail_advance(buf, n * sizeof(*recs));
+
+	return n;
+}
+
+/* Function to stop the capture threads, then merge what they left queued */
+static void capture_end(struct ring_buffer *buf)
+{
+	int i, timeout = 0;
+
+	atomic_store(&capture_stop, true);
+	store_signal(capture_stop_fd);
+	for(i = 0; i < ncaptures; i++) {
+		pthread_join(captures[i].thread, NULL);
+		/* Nothing more is coming, so nothing need wait */
+		atomic_store(&captures[i].watermark, ULLONG_MAX);
+	}
+	while(merge_func(buf, &timeout) > 0)
+		;
+
+	for(i = 0; i < ncaptures; i++) {
+		spsc_queue_free(&captures[i].q);
+	}
+	close(capture_wake_fd);
+	close(capture_stop_fd);
+	free(captures);
+	captures = NULL;
+}
+
+static int capture_read(struct reactor *reactor __attribute__ ((unused)),
+		struct reactor_handler *h)
+{
+	uint64_t val;
 
-			break;
+	/* The queues are merged after every wakeup */
+	if(read(h->fd, &val, sizeof(val)) < 0 && errno != EAGAIN) {
+		perror("read (eventfd)");
+		return -1;
+	}
+
+	return 0;
+}
+
+static const struct reactor_ops capture_ops = {
+	capture_read,
+	NULL,
+	NULL,
+};
+
+static int store_read(struct reactor *reactor __attribute__ ((unused)),
+		struct reactor_handler *h)
+{
+	uint64_t val;
+
+	/* Clients waiting on a flush are checked after every wakeup */
+	if(read(h->fd, &val, sizeof(val)) < 0 && errno != EAGAIN) {
+		perror("read (eventfd)");
+		return -1;
+	}
+
+	return 0;
+}
+
+static const struct reactor_ops store_ops = {
+	store_read,
+	NULL,
+	NULL,
+};
+
+static int client_read(struct reactor *reactor, struct reactor_handler *h)
+{
+	struct client *c = container_of(h, struct client, h);
+
+	/* Only a hang up or error gets here while the client is held back */
+	if(c->tx_wait >= 0) {
+		return -1;
+	}
+
+	return command_func(reactor, c);
+}
+
+static int client_write(struct reactor *reactor __attribute__ ((unused)),
+		struct reactor_handler *h)
+{
+	return send_func(container_of(h, struct client, h));
+}
+
+static struct reactor_handler *listens;
+static int nlistens;
+
+/* Function to start or stop accepting clients on all transports */
+static void listen_func(struct reactor *reactor, bool accepting)
+{
+	int i;
+
+	for(i = 0; i < nlistens; i++) {
+		if((accepting ? reactor_add(reactor, &listens[i], false) :
+					reactor_del(reactor, &listens[i])) < 0) {
+			perror("epoll_ctl");
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+static void client_close(struct reactor *reactor, struct reactor_handler *h)
+{
+	struct client *c = container_of(h, struct client, h);
+
+	reactor_del(reactor, h);
+	close(h->fd);
+	h->fd = -1;
+	past_stop(c);
+
+	/* Accept clients again, if all were being served */
+	if(nclients-- == max_clients) {
+		listen_func(reactor, true);
+	}
+}
+
+static const struct reactor_ops client_ops = {
+	client_read,
+	client_write,
+	client_close,
+};
+
+static int listen_read(struct reactor *reactor, struct reactor_handler *h)
+{
+	struct client *c;
+	int fd, i;
+
+	if((fd = accept4(h->fd, NULL, NULL, SOCK_NONBLOCK)) < 0) {
+		perror("accept");
+		return 0;
+	}
+
+	for(i = 0; clients[i].h.fd >= 0; i++)
+		;
+	c = &clients[i];
+	c->h.fd = fd;
+	command_buf_clear(&c->cmd);
+	c->tx_wait = -1;
+	c->out_head = c->out_tail = c->sent_mark = 0;
+	c->held = false;
+	c->fmt = FMT_HEX;
+	c->next = c->sent_mark_id = ring_sent_id;
+	for(i = 0; i < c->nfilts; i++) {
+		mesg_filter_clear(&c->filts[i]);
+	}
+	c->filtering = false;
+	c->acking = false;
+	c->acked = c->next;
+	c->unacked_head = c->unacked_cnt = 0;
+	c->window_shut = false;
+	c->rtt_timing = false;
+	c->srtt_us = 0;
+	c->db_iter = NULL;
+	c->replaying = false;
+	c->catching_up = false;
+	c->past_pending = false;
+	if(reactor_add(reactor, &c->h, false) < 0) {
+		perror("epoll_ctl");
+		exit(EXIT_FAILURE);
+	}
+
+	/* Stop accepting when every client slot is in use */
+	if(++nclients == max_clients) {
+		listen_func(reactor, false);
+	}
+
+	return 0;
+}
+
+static const struct reactor_ops listen_ops = {
+	listen_read,
+	NULL,
+	NULL,
+};
+
+/*
+ * Metrics
+ *
+ * Written to a file now and then, rather than served, so reading them never
+ * costs the loop anything; the file is replaced whole, so it is always complete.
+ */
+static const char *metrics_path;
+
+/* Function to write out the counters, and rates over the last secs seconds */
+static void metrics_func(struct ring_buffer *buf, int ns, double secs)
+{
+	static unsigned long long tx_bytes_last;
+	struct metrics_file mf;
+	char labels[64];
+	db_key_t oldest;
+	int i;
+
+	if(metrics_begin(&mf, metrics_path) < 0) {
+		perror("metrics");
+		return;
+	}
+
+	metrics_type(&mf, "isoblued_rx_messages_total", "counter",
+			"CAN messages received");
+	for(i = 0; i < ns; i++) {
+		snprintf(labels, sizeof(labels), "{iface=\"%s\"}", cans[i].name);
+		metrics_count(&mf, "isoblued_rx_messages_total", labels,
+				cans[i].mesgs);
+	}
+	metrics_type(&mf, "isoblued_rx_messages_per_second", "gauge",
+			"CAN messages received per second, since the last write");
+	for(i = 0; i < ns; i++) {
+		snprintf(labels, sizeof(labels), "{iface=\"%s\"}", cans[i].name);
+		metrics_gauge(&mf, "isoblued_rx_messages_per_second", labels,
+				(cans[i].mesgs - cans[i].mesgs_last) / secs);
+		cans[i].mesgs_last = cans[i].mesgs;
+	}
+	metrics_type(&mf, "isoblued_rx_calls_total", "counter",
+			"Receive calls on the CAN sockets");
+	metrics_count(&mf, "isoblued_rx_calls_total", NULL, stats.rx_calls);
+	if(captures) {
+		metrics_type(&mf, "isoblued_capture_queue_depth", "gauge",
+				"Messages read by a capture thread, waiting to be merged");
+		for(i = 0; i < ncaptures; i++) {
+			snprintf(labels, sizeof(labels), "{iface=\"%s\"}", cans[i].name);
+			metrics_count(&mf, "isoblued_capture_queue_depth", labels,
+					spsc_queue_depth(&captures[i].q));
+		}
+		metrics_type(&mf, "isoblued_capture_full_total", "counter",
+				"Times a capture thread found its queue full");
+		for(i = 0; i < ncaptures; i++) {
+			snprintf(labels, sizeof(labels), "{iface=\"%s\"}", cans[i].name);
+			metrics_count(&mf, "isoblued_capture_full_total", labels,
+					metrics_get(&captures[i].full));
 		}
+		metrics_type(&mf, "isoblued_merge_held_total", "counter",
+				"Times merging waited for an older message which could still "
+				"come in");
+		metrics_count(&mf, "isoblued_merge_held_total", NULL,
+				stats.merge_held);
+	}
+
+	ring_sent_catch_up(buf);
+	oldest = ring_oldest(buf);
+	metrics_type(&mf, "isoblued_ring_capacity_bytes", "gauge",
+			"Size of the ring buffer");
+	metrics_count(&mf, "isoblued_ring_capacity_bytes", NULL,
+			buf->count_bytes);
+	metrics_type(&mf, "isoblued_ring_used_bytes", "gauge",
+			"Bytes of messages in the ring buffer");
+	metrics_count(&mf, "isoblued_ring_used_bytes", NULL,
+			(db_id - oldest) * sizeof(struct mesg_rec));
+	metrics_type(&mf, "isoblued_ring_unsent_bytes", "gauge",
+			"Bytes of messages in the ring buffer no client was sent yet");
+	metrics_count(&mf, "isoblued_ring_unsent_bytes", NULL,
+			(db_id - ring_sent_id) * sizeof(struct mesg_rec));
+	metrics_type(&mf, "isoblued_ring_overwritten_bytes_total", "counter",
+			"Bytes of messages overwritten before any client was sent them");
+	metrics_count(&mf, "isoblued_ring_overwritten_bytes_total", NULL,
+			stats.ring_lost * sizeof(struct mesg_rec));
+	metrics_type(&mf, "isoblued_client_skipped_messages_total", "counter",
+			"Messages overwritten before a connected client was sent them");
+	metrics_count(&mf, "isoblued_client_skipped_messages_total", NULL,
+			stats.client_skipped);
+	metrics_type(&mf, "isoblued_client_gaps_total", "counter",
+			"Gap records sent to clients for messages they missed");
+	metrics_count(&mf, "isoblued_client_gaps_total", NULL, stats.client_gaps);
+	metrics_type(&mf, "isoblued_client_catch_ups_total", "counter",
+			"Times a client was sent messages from storage the buffer lost");
+	metrics_count(&mf, "isoblued_client_catch_ups_total", NULL,
+			stats.client_catch_ups);
+
+	metrics_type(&mf, "isoblued_clients", "gauge", "Connected clients");
+	metrics_count(&mf, "isoblued_clients", NULL, nclients);
+	metrics_type(&mf, "isoblued_client_sent_bytes_total", "counter",
+			"Bytes sent to clients");
+	metrics_count(&mf, "isoblued_client_sent_bytes_total", NULL,
+			stats.tx_bytes);
+	metrics_type(&mf, "isoblued_client_sends_total", "counter",
+			"Sends to clients");
+	metrics_count(&mf, "isoblued_client_sends_total", NULL, stats.tx_sends);
+	metrics_type(&mf, "isoblued_client_sent_bytes_per_second", "gauge",
+			"Bytes sent to clients per second, since the last write");
+	metrics_gauge(&mf, "isoblued_client_sent_bytes_per_second", NULL,
+			(stats.tx_bytes - tx_bytes_last) / secs);
+	tx_bytes_last = stats.tx_bytes;
+	metrics_hist(&mf, "isoblued_client_held_us",
+			"Microseconds messages waited to be sent to a client",
+			&stats.tx_held_hist);
+
+	metrics_type(&mf, "isoblued_ack_window", "gauge",
+			"Messages a client which ACKs may have unacknowledged");
+	metrics_count(&mf, "isoblued_ack_window", NULL, ack_window);
+	metrics_type(&mf, "isoblued_acks_total", "counter",
+			"Acknowledgements from clients");
+	metrics_count(&mf, "isoblued_acks_total", NULL, stats.acks);
+	metrics_type(&mf, "isoblued_acks_stale_total", "counter",
+			"Acknowledgements of messages not sent or already acknowledged");
+	metrics_count(&mf, "isoblued_acks_stale_total", NULL, stats.ack_stale);
+	metrics_type(&mf, "isoblued_ack_window_full_total", "counter",
+			"Times a client's window held back messages waiting for it");
+	metrics_count(&mf, "isoblued_ack_window_full_total", NULL,
+			stats.ack_window_full);
+	metrics_hist(&mf, "isoblued_ack_rtt_us",
+			"Microseconds from a send to its acknowledgement",
+			&stats.ack_rtt_hist);
+	metrics_type(&mf, "isoblued_client_unacked_messages", "gauge",
+			"Live messages sent to a client and not yet acknowledged");
+	for(i = 0; i < max_clients; i++) {
+		if(clients[i].h.fd >= 0 && clients[i].acking) {
+			snprintf(labels, sizeof(labels), "{client=\"%d\"}", i);
+			metrics_count(&mf, "isoblued_client_unacked_messages", labels,
+					clients[i].unacked_cnt);
+		}
+	}
+	metrics_type(&mf, "isoblued_client_srtt_us", "gauge",
+			"Smoothed round trip time to a client, in microseconds");
+	for(i = 0; i < max_clients; i++) {
+		if(clients[i].h.fd >= 0 && clients[i].acking) {
+			snprintf(labels, sizeof(labels), "{client=\"%d\"}", i);
+			metrics_count(&mf, "isoblued_client_srtt_us", labels,
+					clients[i].srtt_us);
 		}
+	}
 
-		memmove(buffer, buffer+curs, tail-curs);
-		tail -= curs;
-		curs = 0;
+	metrics_type(&mf, "isoblued_bus_queued_total", "counter",
+			"Messages clients queued to send on the bus");
+	metrics_count(&mf, "isoblued_bus_queued_total", NULL, stats.bus_queued);
+	metrics_type(&mf, "isoblued_bus_sent_total", "counter",
+			"Messages sent on the bus");
+	metrics_count(&mf, "isoblued_bus_sent_total", NULL, stats.bus_sent);
+	metrics_type(&mf, "isoblued_bus_failed_total", "counter",
+			"Messages that could not be sent on the bus");
+	metrics_count(&mf, "isoblued_bus_failed_total", NULL, stats.bus_failed);
+	metrics_type(&mf, "isoblued_replay_records_total", "counter",
+			"Records replayed from storage");
+	metrics_count(&mf, "isoblued_replay_records_total", NULL,
+			stats.replay_recs);
+
+	metrics_type(&mf, "isoblued_store_queue_depth", "gauge",
+			"Messages waiting for the storage thread");
+	metrics_count(&mf, "isoblued_store_queue_depth", NULL,
+			spsc_queue_depth(&store_q));
+	metrics_type(&mf, "isoblued_store_dropped_total", "counter",
+			"Messages not stored because the storage thread was full");
+	metrics_count(&mf, "isoblued_store_dropped_total", NULL,
+			stats.store_dropped);
+	metrics_type(&mf, "isoblued_store_messages_total", "counter",
+			"Messages committed to storage");
+	metrics_count(&mf, "isoblued_store_messages_total", NULL,
+			metrics_get(&stats.db_mesgs));
+	metrics_type(&mf, "isoblued_store_commits_total", "counter",
+			"Commits to storage");
+	metrics_count(&mf, "isoblued_store_commits_total", NULL,
+			metrics_get(&stats.db_commits));
+	metrics_hist(&mf, "isoblued_store_commit_us",
+			"Microseconds each commit to storage took",
+			&stats.db_commit_hist);
+	metrics_type(&mf, "isoblued_store_bytes", "gauge",
+			"Bytes of storage on disk");
+	metrics_count(&mf, "isoblued_store_bytes", NULL,
+			metrics_get(&retain_bytes));
+	metrics_type(&mf, "isoblued_retain_deleted_total", "counter",
+			"Messages deleted to keep storage within its limits");
+	metrics_count(&mf, "isoblued_retain_deleted_total", NULL,
+			metrics_get(&stats.retain_mesgs));
+
+	if(metrics_end(&mf) < 0) {
+		perror("metrics");
 	}
 }
 
 /* Function that does all the work after initialization */
-static inline void loop_func(int n_fds, fd_set read_fds, fd_set write_fds,
-		struct ring_buffer buf, int *s, int ns, int bt)
+static inline void loop_func(struct ring_buffer *buf, int *s, int ns,
+		char **names, int *ls, int nls)
 {
-	int rc = -1;
+	struct reactor reactor;
+	struct reactor_handler store = { 0 }, capture = { 0 };
+	int i;
 
-	while(1) {
-		fd_set tmp_rfds = read_fds, tmp_wfds = write_fds;
-		if(wait_func(n_fds, &tmp_rfds, &tmp_wfds) == 0) {
-			continue;
+	if(reactor_create(&reactor) < 0) {
+		perror("epoll_create");
+		return;
+	}
+
+	cans = calloc(ns, sizeof(*cans));
+	txqs = calloc(ns, sizeof(*txqs));
+	ntxqs = ns;
+	for(i = 0; i < ns; i++) {
+		cans[i].h.fd = s[i];
+		cans[i].h.ops = capture_threads ? &capture_can_ops : &can_ops;
+		cans[i].iface = i;
+		cans[i].buf = buf;
+		cans[i].name = names[i];
+		txqs[i].h = &cans[i].h;
+
+		/* Capture threads do the reading, if there are any */
+		if(reactor_add(&reactor, &cans[i].h, false) < 0 ||
+				(capture_threads &&
+				 reactor_want_read(&reactor, &cans[i].h, false) < 0)) {
+			perror("epoll_ctl");
+			return;
 		}
+	}
 
-		/* Read ISOBUS */
-		int i;
-		for(i = 0; i < ns; i++) {
-			if(!FD_ISSET(s[i], &tmp_rfds)) {
-				continue;
+	store.fd = store_done_fd;
+	store.ops = &store_ops;
+	if(reactor_add(&reactor, &store, false) < 0) {
+		perror("epoll_ctl");
+		return;
+	}
+
+	clients = calloc(max_clients, sizeof(*clients));
+	for(i = 0; i < max_clients; i++) {
+		clients[i].h.fd = -1;
+		clients[i].h.ops = &client_ops;
+		clients[i].buf = buf;
+		if(command_buf_create(&clients[i].cmd, CMD_BUF_SIZE) < 0) {
+			perror("command_buf_create");
+			return;
+		}
+		clients[i].past = aligned_alloc(sizeof(struct mesg_rec),
+				REPLAY_PREFETCH * sizeof(struct mesg_rec));
+		clients[i].filts = calloc(ns, sizeof(*clients[i].filts));
+		clients[i].nfilts = ns;
+		clients[i].unacked = calloc(ack_window, sizeof(*clients[i].unacked));
+	}
+	ring_recover(buf);
+
+	if(capture_threads) {
+		if(capture_start(s, ns, capture_cpus) < 0) {
+			perror("capture threads");
+			return;
+		}
+		capture.fd = capture_wake_fd;
+		capture.ops = &capture_ops;
+		if(reactor_add(&reactor, &capture, false) < 0) {
+			perror("epoll_ctl");
+			return;
+		}
+	}
+
+	listens = calloc(nls, sizeof(*listens));
+	nlistens = nls;
+	for(i = 0; i < nls; i++) {
+		listens[i].fd = ls[i];
+		listens[i].ops = &listen_ops;
+	}
+	listen_func(&reactor, true);
+
+	struct timespec ring_saved, metrics_saved;
+	clock_gettime(CLOCK_MONOTONIC, &ring_saved);
+	metrics_saved = ring_saved;
+	int timeout = RING_CHECKPOINT;
+	int metrics_timeout;
+	while(!done && !stop_req) {
+		if(stats_req) {
+			stats_req = 0;
+			print_stats();
+		}
+
+		if(reactor_wait(&reactor, timeout) < 0) {
+			exit(EXIT_FAILURE);
+		}
+
+		/* Save the buffer's offsets now and then, not every time they move */
+		if((timeout = RING_CHECKPOINT - ms_since(&ring_saved)) <= 0) {
+			ring_checkpoint(buf, MS_ASYNC);
+			clock_gettime(CLOCK_MONOTONIC, &ring_saved);
+			timeout = RING_CHECKPOINT;
+		}
+
+		/* Take in what the capture threads have read, oldest first */
+		if(captures) {
+			while(merge_func(buf, &timeout) == MERGE_BATCH)
+				;
+		}
+
+		if(metrics_path) {
+			long ms = ms_since(&metrics_saved);
+
+			if((metrics_timeout = METRICS_PERIOD - ms) <= 0) {
+				metrics_func(buf, ns, ms / 1000.0);
+				clock_gettime(CLOCK_MONOTONIC, &metrics_saved);
+				metrics_timeout = METRICS_PERIOD;
 			}
+			if(metrics_timeout < timeout) {
+				timeout = metrics_timeout;
+			}
+		}
 
-			if(read_func(s[i], i, &buf) < 0) {
-				return;
+		/* Send messages clients queued since last time, all at once */
+		tx_func(&reactor, &timeout);
+
+		/* Only wait to write once there is enough to send */
+		for(i = 0; i < max_clients; i++) {
+			if(clients[i].h.fd >= 0) {
+				reactor_want_write(&reactor, &clients[i].h,
+						send_due(&clients[i], &timeout));
 			}
 		}
+	}
 
-		/* Check RFCOMM connection */
-		if(rc > 0) {
-			/* Read RFCOMM */
-			if(FD_ISSET(rc, &tmp_rfds)) {
-				if(command_func(rc, &buf, s) < 0) {
-					FD_CLR(rc, &read_fds);
-					FD_CLR(rc, &write_fds);
-					FD_SET(bt, &read_fds);
-					close(rc);
-					rc = -1;
-					continue;
-				}
+	if(captures) {
+		capture_end(buf);
+	}
+	ring_checkpoint(buf, 0);
+
+	for(i = 0; i < max_clients; i++) {
+		if(clients[i].h.fd >= 0) {
+			close(clients[i].h.fd);
+		}
+		command_buf_free(&clients[i].cmd);
+		free(clients[i].past);
+		free(clients[i].filts);
+		free(clients[i].unacked);
+	}
+	free(clients);
+	free(listens);
+	free(txqs);
+	free(cans);
+	reactor_free(&reactor);
+}
+
+/*
+ * Function to write the time index out with 64-bit IDs, if it has 32-bit ones
+ *
+ * Entries from then were a second and ID, so they have IDs (never 0) where
+ * entries now have padding. Returns 1 if TIME_INDEX_NEW_PATH was written.
+ */
+static int time_index_convert(void)
+{
+	struct { uint32_t sec; uint32_t id; } old;
+	struct time_index_ent ent = { 0 };
+	FILE *in, *out;
+	size_t n;
+	int ret = 1;
+
+	unlink(TIME_INDEX_NEW_PATH);
+	if(!(in = fopen(TIME_INDEX_PATH, "rb"))) {
+		return errno == ENOENT ? 0 : -1;
+	}
+	while((n = fread(&ent, 1, sizeof(ent), in)) == sizeof(ent) && !ent.pad)
+		;
+	/* Only a whole entry with an ID in its padding; a torn one proves nothing */
+	if(n != sizeof(ent) || !ent.pad) {
+		fclose(in);
+		return 0;
+	}
+
+	rewind(in);
+	if(!(out = fopen(TIME_INDEX_NEW_PATH, "wb"))) {
+		fclose(in);
+		return -1;
+	}
+	ent.pad = 0;
+	while(fread(&old, sizeof(old), 1, in) == 1) {
+		ent.sec = old.sec;
+		ent.id = old.id;
+		if(fwrite(&ent, sizeof(ent), 1, out) != 1) {
+			ret = -1;
+			break;
+		}
+	}
+	fclose(in);
+	if(fflush(out) || fsync(fileno(out)) < 0) {
+		ret = -1;
+	}
+	if(fclose(out) || ret < 0) {
+		return -1;
+	}
+
+	return ret;
+}
+
+/*
+ * Function to finish moving a store over, once the old one is set aside
+ *
+ * Steps already done are skipped, so this also finishes a move stopped part
+ * way through on the next start up.
+ */
+static int db_migrate_finish(void)
+{
+	leveldb_options_t *options;
+	char *err = NULL;
+
+	if(access(LEVELDB_PATH, F_OK) &&
+			rename(LEVELDB_NEW_PATH, LEVELDB_PATH) < 0) {
+		perror("rename");
+		return -1;
+	}
+	/*
+	 * Written before the stores were swapped; if it is not there, the index
+	 * already moved in (or there is none), so is left alone
+	 */
+	if(!access(TIME_INDEX_NEW_PATH, F_OK) &&
+			rename(TIME_INDEX_NEW_PATH, TIME_INDEX_PATH) < 0) {
+		perror("rename");
+		return -1;
+	}
+
+	/* Left behind, it is only tried again next time */
+	options = leveldb_options_create();
+	leveldb_destroy_db(options, LEVELDB_V1_PATH, &err);
+	leveldb_options_destroy(options);
+	if(err) {
+		fprintf(stderr, "Leveldb destroy error: %s\n", err);
+		leveldb_free(err);
+	}
+
+	return 0;
+}
+
+/*
+ * Function to move a store from before IDs were 64-bit over to big-endian
+ * keys, once, rebuilding its PGN index on the way
+ *
+ * Messages are copied to a new store, which then takes the old one's place.
+ * Returns -1 if that fails, leaving the old store as it was.
+ */
+static int db_migrate(void)
+{
+	leveldb_options_t *old_options, *new_options;
+	leveldb_comparator_t *cmp;
+	leveldb_t *old, *new;
+	leveldb_iterator_t *iter;
+	leveldb_writebatch_t *wb;
+	struct pgn_index_batch batch;
+	char key[PGN_INDEX_ID_LEN], val[PGN_INDEX_ID_LEN];
+	char *err = NULL;
+	unsigned long long n = 0;
+	int batched = 0, ret = -1;
+
+	/* Finish a move stopped after the old store was set aside */
+	if(!access(LEVELDB_V1_PATH, F_OK)) {
+		printf("Finishing moving stored messages over to 64-bit IDs...\n");
+		return db_migrate_finish() < 0 ? -1 : 1;
+	}
+
+	/* Only stores ordered by the old comparator open with it */
+	old_options = leveldb_options_create();
+	cmp = leveldb_comparator_create(NULL, leveldb_cmp_destroy,
+			leveldb_cmp_compare, leveldb_cmp_name);
+	leveldb_options_set_comparator(old_options, cmp);
+	old = leveldb_open(old_options, LEVELDB_PATH, &err);
+	if(err) {
+		leveldb_free(err);
+		leveldb_options_destroy(old_options);
+		leveldb_comparator_destroy(cmp);
+		return 0;
+	}
+	printf("Moving stored messages over to 64-bit IDs...\n");
+
+	new_options = leveldb_options_create();
+	leveldb_options_set_create_if_missing(new_options, 1);
+	leveldb_destroy_db(new_options, LEVELDB_NEW_PATH, &err);
+	if(!err) {
+		new = leveldb_open(new_options, LEVELDB_NEW_PATH, &err);
+	}
+	if(err) {
+		fprintf(stderr, "Leveldb open error: %s\n", err);
+		leveldb_free(err);
+		leveldb_close(old);
+		leveldb_options_destroy(new_options);
+		leveldb_options_destroy(old_options);
+		leveldb_comparator_destroy(cmp);
+		return -1;
+	}
+	wb = leveldb_writebatch_create();
+	if(pgn_index_batch_create(&batch, PGN_INDEX_BATCH) < 0) {
+		perror("pgn_index_batch_create");
+		exit(EXIT_FAILURE);
+	}
+
+	/* Messages come first, in ID order, then the old index entries */
+	iter = leveldb_create_iterator(old, db_scan_roptions);
+	for(leveldb_iter_seek_to_first(iter); leveldb_iter_valid(iter);
+			leveldb_iter_next(iter)) {
+		const char *k, *v;
+		size_t klen, vlen;
+		uint32_t id;
+
+		k = leveldb_iter_key(iter, &klen);
+		if(klen != sizeof(id)) {
+			break;
+		}
+		memcpy(&id, k, sizeof(id));
+		v = leveldb_iter_value(iter, &vlen);
+
+		pgn_index_put_id(key, id);
+		if(id == LEVELDB_ID_KEY) {
+			/* The next ID */
+			if(vlen != sizeof(id)) {
+				continue;
 			}
+			memcpy(&id, v, sizeof(id));
+			pgn_index_put_id(val, id);
+			leveldb_writebatch_put(wb, key, sizeof(key), val, sizeof(val));
+		} else {
+			/* Values stay hex, as streamed; the PGN follows the ID */
+			leveldb_writebatch_put(wb, key, sizeof(key), v, vlen);
+			if(vlen >= HEX_MESG_FIXED) {
+				uint32_t pgn;
 
-			/* Write RFCOMM */
-			if(FD_ISSET(rc, &tmp_wfds)) {
-				if(send_func(rc, &buf) < 0) {
-					FD_CLR(rc, &read_fds);
-					FD_CLR(rc, &write_fds);
-					FD_SET(bt, &read_fds);
-					close(rc);
-					rc = -1;
-					continue;
+				if(hex_get(v + 1 + 8, 5, &pgn) == 0) {
+					pgn_index_batch_add(&batch, wb, pgn, id);
 				}
 			}
+			n++;
+		}
 
-			/* Check send buffer */
-			check_send(&buf, rc, &write_fds);
-		} else {
-			/* Accept Bluetooth connection */
-			if(FD_ISSET(bt, &tmp_rfds)) {
-				if((rc = accept(bt, NULL, NULL)) < 0) {
-					perror("accept");
-				} else {
-					FD_SET(rc, &read_fds);
-					FD_SET(rc, &write_fds);
-					n_fds = rc > n_fds ? rc : n_fds;
-					FD_CLR(bt, &read_fds);
-				}
+		if(++batched == MIGRATE_BATCH) {
+			batched = 0;
+			pgn_index_batch_flush(&batch, wb);
+			leveldb_write(new, db_woptions, wb, &err);
+			leveldb_writebatch_clear(wb);
+			if(err) {
+				break;
 			}
 		}
 	}
-}
+	if(!err) {
+		pgn_index_batch_flush(&batch, wb);
+		leveldb_write(new, db_woptions, wb, &err);
+	}
+	leveldb_iter_destroy(iter);
+	leveldb_writebatch_destroy(wb);
+	pgn_index_batch_free(&batch);
+	leveldb_close(new);
+	leveldb_close(old);
+
+	/*
+	 * The old store is set aside only once everything is written, so either
+	 * it is still in place or db_migrate_finish can finish the swap
+	 */
+	if(err) {
+		fprintf(stderr, "Leveldb write error: %s\n", err);
+		leveldb_free(err);
+	} else if(time_index_convert() < 0) {
+		perror("time index");
+	} else if(rename(LEVELDB_PATH, LEVELDB_V1_PATH) < 0) {
+		perror("rename");
+	} else if(db_migrate_finish() == 0) {
+		printf("Moved %llu stored messages.\n", n);
+		ret = 1;
+	}
 
-int main(int argc, char *argv[]) {
-	fd_set read_fds, write_fds;
-	int n_fds;
+	leveldb_options_destroy(new_options);
+	leveldb_options_destroy(old_options);
+	leveldb_comparator_destroy(cmp);
 
-	struct sockaddr_rc rc_addr = { 0 };
-	socklen_t len;
-	sdp_session_t *session;
+	return ret;
+}
 
-	int bt;
+int main(int argc, char *argv[]) {
+	int i;
+	int *ls;
 	int ns;
 	int *s;
 	struct ring_buffer buf;
@@ -735,42 +3597,87 @@ int main(int argc, char *argv[]) {
 		sizeof(DEF_IFACES) / sizeof(*DEF_IFACES),
 		0,
 		0,
+		RECV_BATCH_DEF,
+		COMMIT_COUNT_DEF,
+		COMMIT_AGE_DEF,
+		STORE_ORDER_DEF,
+		STORE_HWM_DEF,
+		TIME_INDEX_DEF,
+		0,
+		0,
+		0,
+		NULL,
+		MAX_CLIENTS_DEF,
+		SEND_DELAY_DEF,
+		SEND_SIZE_DEF,
+		ACK_WINDOW_DEF,
+		false,
+		NULL,
+		MERGE_DELAY_DEF,
+		{ NULL },
+		0,
 	};
 	argp_parse(&argp, argc, argv, 0, 0, &arguments);
+	recv_batch = arguments.recv_batch;
+	commit_count = arguments.commit_count;
+	commit_age = arguments.commit_age;
+	max_clients = arguments.max_clients;
+	send_delay = arguments.send_delay;
+	send_size = arguments.send_size;
+	ack_window = arguments.ack_window;
+	capture_threads = arguments.capture_threads;
+	capture_cpus = arguments.capture_cpus;
+	merge_delay = arguments.merge_delay;
+	retain_size = arguments.retain_size * 1048576ULL;
+	retain_age = arguments.retain_age;
+	metrics_path = arguments.metrics;
+
+	/* Print statistics on request */
+	struct sigaction sa = { 0 };
+	sa.sa_handler = stats_handler;
+	sigemptyset(&sa.sa_mask);
+	if(sigaction(SIGUSR1, &sa, NULL) < 0) {
+		perror("sigaction");
+		return EXIT_FAILURE;
+	}
+
+	/* Stop cleanly, so the buffer and storage are saved for a restart */
+	sa.sa_handler = stop_handler;
+	if(sigaction(SIGTERM, &sa, NULL) < 0 || sigaction(SIGINT, &sa, NULL) < 0) {
+		perror("sigaction");
+		return EXIT_FAILURE;
+	}
 
 	s = calloc(arguments.nifaces, sizeof(*s));
 	ns = arguments.nifaces;
-	FD_ZERO(&read_fds);
-	FD_ZERO(&write_fds);
-	n_fds = 0;
 
-	if((bt = socket(PF_BLUETOOTH, SOCK_STREAM | SOCK_NONBLOCK, BTPROTO_RFCOMM))
-			< 0) {
-		perror("socket (bt)");
-		return EXIT_FAILURE;
+	/* Listen for clients, over Bluetooth unless told otherwise */
+	if(!arguments.ntransports) {
+		static char rfcomm[sizeof("rfcomm:255")];
+		snprintf(rfcomm, sizeof(rfcomm), "rfcomm:%d", arguments.channel);
+		arguments.transports[arguments.ntransports++] = rfcomm;
 	}
-	rc_addr.rc_family = AF_BLUETOOTH;
-	rc_addr.rc_bdaddr = *BDADDR_ANY;
-	rc_addr.rc_channel = arguments.channel;
-	if(bind(bt, (struct sockaddr *)&rc_addr, sizeof(rc_addr)) < 0) {
-		perror("bind bt");
-		return EXIT_FAILURE;
+	ls = calloc(arguments.ntransports, sizeof(*ls));
+	for(i = 0; i < arguments.ntransports; i++) {
+		if((ls[i] = listen_transport(arguments.transports[i], max_clients))
+				< 0) {
+			return EXIT_FAILURE;
+		}
 	}
-	listen(bt, 1);
-	len = sizeof(rc_addr);
-	if(getsockname(bt, (struct sockaddr *)&rc_addr, &len) < 0) {
-		perror("getsockname");
+
+	if(ring_buffer_create(&buf, 20 + arguments.buf_order, arguments.file) < 0) {
+		perror("ring_buffer_create");
 		return EXIT_FAILURE;
 	}
-	FD_SET(bt, &read_fds);
-	n_fds = bt > n_fds ? bt : n_fds;
-
-	session = register_service(rc_addr.rc_channel);
-
-	ring_buffer_create(&buf, 20 + arguments.buf_order, arguments.file);
+	buf.record_bytes = sizeof(struct mesg_rec);
+	/* Records from before IDs were 64-bit can not be resumed */
+	if(buf.recovered && buf.format != RING_FORMAT) {
+		fprintf(stderr, "Buffer is of an older format, not resuming it\n");
+		buf.recovered = 0;
+	}
+	buf.format = RING_FORMAT;
 
 	/* Initialize ISOBUS sockets */
-	int i;
 	for(i = 0; i < arguments.nifaces; i++) {
 		struct sockaddr_can addr = { 0 };
 		struct ifreq ifr;
@@ -798,49 +3705,124 @@ int main(int argc, char *argv[]) {
 		setsockopt(s[i], SOL_CAN_ISOBUS, CAN_ISOBUS_DADDR, &val, sizeof(val));
 		/* Timestamp messages */
 		setsockopt(s[i], SOL_SOCKET, SO_TIMESTAMP, &val, sizeof(val));
-
-		FD_SET(s[i], &read_fds);
-		n_fds = s[i] > n_fds ? s[i] : n_fds;
 	}
 
-	/* Initialize Leveldb */
-	db_options = leveldb_options_create();
-	leveldb_options_set_create_if_missing(db_options, 1);
-	leveldb_comparator_t *db_cmp;
-	db_cmp = leveldb_comparator_create(NULL,
-			leveldb_cmp_destroy, leveldb_cmp_compare, leveldb_cmp_name);
-	leveldb_options_set_comparator(db_options, db_cmp);
-	db = leveldb_open(db_options, "isoblued_db", &db_err);
-	if(db_err) {
-		fprintf(stderr, "Leveldb open error.\n");
-		exit(EXIT_FAILURE);
-	}
-	db_woptions = leveldb_writeoptions_create();
-	leveldb_writeoptions_set_sync(db_woptions, false);
-	db_roptions = leveldb_readoptions_create();
-	db_iter = NULL; //leveldb_create_iterator(db, db_roptions);
-	db_id = 1;
-	size_t read_len;
-	char * read = leveldb_get(db, db_roptions, (char *)&LEVELDB_ID_KEY,
-			sizeof(db_key_t), &read_len, &db_err);
-	if(db_err || !read_len) {
-		leveldb_put(db, db_woptions, (char *)&LEVELDB_ID_KEY, sizeof(db_key_t),
-				(char *)&db_id, sizeof(db_id), &db_err);
+	/* Initialize the log, if asked for, or Leveldb */
+	if(arguments.log_segment) {
+		db_use_log = true;
+		if(seg_log_open(&db_log, SEG_LOG_PATH,
+					arguments.log_segment * 1048576UL) < 0) {
+			if(errno == ENOTSUP) {
+				fprintf(stderr, "%s holds a log from before IDs were 64-bit, "
+						"which can not be read; move it aside to start a new "
+						"one\n", SEG_LOG_PATH);
+			} else {
+				perror("seg_log_open");
+			}
+			return EXIT_FAILURE;
+		}
+		db_id = db_log.last_id + 1;
+	} else {
+		db_woptions = leveldb_writeoptions_create();
+		leveldb_writeoptions_set_sync(db_woptions, false);
+		db_roptions = leveldb_readoptions_create();
+		db_scan_roptions = leveldb_readoptions_create();
+		leveldb_readoptions_set_fill_cache(db_scan_roptions, 0);
+		if(db_migrate() < 0) {
+			fprintf(stderr, "Could not move stored messages to 64-bit IDs.\n");
+			exit(EXIT_FAILURE);
+		}
+		/* Keys are big-endian, so the default comparator orders them */
+		db_options = leveldb_options_create();
+		leveldb_options_set_create_if_missing(db_options, 1);
+		db = leveldb_open(db_options, LEVELDB_PATH, &db_err);
 		if(db_err) {
-			fprintf(stderr, "Leveldb db init error.\n");
+			fprintf(stderr, "Leveldb open error.\n");
+			exit(EXIT_FAILURE);
+		}
+		db_batch = leveldb_writebatch_create();
+		if(pgn_index_batch_create(&db_pgn_batch, PGN_INDEX_BATCH) < 0) {
+			perror("pgn_index_batch_create");
+			return EXIT_FAILURE;
+		}
+		db_id = 1;
+		size_t read_len;
+		char id_key[PGN_INDEX_ID_LEN], id_val[PGN_INDEX_ID_LEN];
+		pgn_index_put_id(id_key, LEVELDB_ID_KEY);
+		char * read = leveldb_get(db, db_roptions, id_key, sizeof(id_key),
+				&read_len, &db_err);
+		if(db_err || read_len != sizeof(id_val)) {
+			pgn_index_put_id(id_val, db_id);
+			leveldb_put(db, db_woptions, id_key, sizeof(id_key), id_val,
+					sizeof(id_val), &db_err);
+			if(db_err) {
+				fprintf(stderr, "Leveldb db init error.\n");
+			} else {
+				printf("Leveldb init new db.\n");
+			}
 		} else {
-			printf("Leveldb init new db.\n");
+			db_id = pgn_index_get_id(read);
 		}
-	} else {
-		db_id = *(db_key_t *)read;
 	}
-	printf("starting at db id %d.\n", db_id);
+	printf("starting at db id %llu.\n", (unsigned long long)db_id);
+
+	if(time_index_open(&time_idx, TIME_INDEX_PATH, arguments.time_index,
+				db_id) < 0) {
+		perror("time_index_open");
+		return EXIT_FAILURE;
+	}
+
+	/* Start storing messages */
+	if(spsc_queue_create(&store_q, arguments.store_order,
+				sizeof(struct mesg_rec)) < 0) {
+		perror("spsc_queue_create");
+		return EXIT_FAILURE;
+	}
+	store_hwm = store_q.count_elems * arguments.store_hwm / 100;
+	if((store_wake_fd = eventfd(0, 0)) < 0 ||
+			(store_done_fd = eventfd(0, EFD_NONBLOCK)) < 0) {
+		perror("eventfd");
+		return EXIT_FAILURE;
+	}
+	db_batch_id = db_id;
+	atomic_init(&store_offered_id, db_id);
+	atomic_init(&store_committed_id, db_id);
+	if((errno = pthread_create(&store_thread, NULL, store_func, NULL))) {
+		perror("pthread_create");
+		return EXIT_FAILURE;
+	}
 
+	/* Keep storage within its limits */
+	if((retain_wake_fd = eventfd(0, 0)) < 0) {
+		perror("eventfd");
+		return EXIT_FAILURE;
+	}
+	if((errno = pthread_create(&retain_thread, NULL, retain_func, NULL))) {
+		perror("pthread_create");
+		return EXIT_FAILURE;
+	}
 
 	/* Do socket stuff */
-	loop_func(n_fds, read_fds, write_fds, buf, s, ns, bt);
+	loop_func(&buf, s, ns, arguments.ifaces, ls, arguments.ntransports);
+
+	/* Stop trimming storage, then store whatever is still queued */
+	atomic_store(&retain_stop, true);
+	store_signal(retain_wake_fd);
+	pthread_join(retain_thread, NULL);
+	atomic_store(&store_stop, true);
+	store_signal(store_wake_fd);
+	pthread_join(store_thread, NULL);
+	time_index_close(&time_idx);
+	if(db_use_log) {
+		seg_log_close(&db_log);
+	}
+	if(ring_buffer_free(&buf) < 0) {
+		perror("ring_buffer_free");
+	}
 
-	sdp_close(session);
+	if(session) {
+		sdp_close(session);
+	}
 
 	return EXIT_SUCCESS;
 }
@@ -0,0 +1,65 @@
+/*
+ * Message Filter Library
+ *
+ *
+ * Author: agent <agent@local>
+ *
+ * Copyright (C) 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <string.h>
+
+#include "mesg_filter.h"
+
+/* Accepts every message; bitmaps are only cleared once they are used */
+void mesg_filter_clear(struct mesg_filter *filter)
+{
+	filter->all_pgns = filter->all_saddrs = filter->all_daddrs = true;
+}
+
+static inline void _mesg_filter_set(uint8_t *bits, size_t len, bool *all,
+		uint32_t val)
+{
+	if(*all) {
+		memset(bits, 0, len);
+		*all = false;
+	}
+
+	bits[val >> 3] |= 1 << (val & 7);
+}
+
+void mesg_filter_add_pgn(struct mesg_filter *filter, uint32_t pgn)
+{
+	_mesg_filter_set(filter->pgns, sizeof(filter->pgns), &filter->all_pgns,
+			pgn & (MESG_FILTER_PGNS - 1));
+}
+
+void mesg_filter_add_saddr(struct mesg_filter *filter, uint8_t saddr)
+{
+	_mesg_filter_set(filter->saddrs, sizeof(filter->saddrs),
+			&filter->all_saddrs, saddr);
+}
+
+void mesg_filter_add_daddr(struct mesg_filter *filter, uint8_t daddr)
+{
+	_mesg_filter_set(filter->daddrs, sizeof(filter->daddrs),
+			&filter->all_daddrs, daddr);
+}
@@ -0,0 +1,86 @@
+/*
+ * Message Filter Library
+ *
+ * Precompiled PGN/source/destination filter for ISOBUS messages. Each field
+ * is either unrestricted or a bitmap of accepted values, so checking a
+ * message is a few bit tests however many values were given.
+ *
+ *
+ * Author: agent <agent@local>
+ *
+ * Copyright (C) 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef MESG_FILTER_H
+#define MESG_FILTER_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* PGNs are 18 bits */
+#define MESG_FILTER_PGNS	(1UL << 18)
+
+struct mesg_filter
+{
+	bool all_pgns;
+	bool all_saddrs;
+	bool all_daddrs;
+
+	uint8_t pgns[MESG_FILTER_PGNS / 8];
+	uint8_t saddrs[256 / 8];
+	uint8_t daddrs[256 / 8];
+};
+
+void mesg_filter_clear(struct mesg_filter *filter);
+void mesg_filter_add_pgn(struct mesg_filter *filter, uint32_t pgn);
+void mesg_filter_add_saddr(struct mesg_filter *filter, uint8_t saddr);
+void mesg_filter_add_daddr(struct mesg_filter *filter, uint8_t daddr);
+
+static inline bool _mesg_filter_bit(const uint8_t *bits, uint32_t val)
+{
+	return bits[val >> 3] & (1 << (val & 7));
+}
+
+/* Checks if the filter lets every message through */
+static inline bool mesg_filter_all(const struct mesg_filter *filter)
+{
+	return filter->all_pgns && filter->all_saddrs && filter->all_daddrs;
+}
+
+/* Checks a message against every field of the filter */
+static inline bool mesg_filter_match(const struct mesg_filter *filter,
+		uint32_t pgn, uint8_t saddr, uint8_t daddr)
+{
+	return (filter->all_pgns || _mesg_filter_bit(filter->pgns,
+				pgn & (MESG_FILTER_PGNS - 1))) &&
+		(filter->all_saddrs || _mesg_filter_bit(filter->saddrs, saddr)) &&
+		(filter->all_daddrs || _mesg_filter_bit(filter->daddrs, daddr));
+}
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif /* MESG_FILTER_H */
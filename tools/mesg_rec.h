@@ -0,0 +1,178 @@
+/*
+ * ISOBlue Message Records
+ *
+ * ISOBUS messages as isoblued keeps them, and their hex and binary record
+ * formats. Shared by isoblued and the benchmarks that measure it.
+ *
+ *
+ * Author: agent <agent@local>
+ *
+ * Copyright (C) 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef MESG_REC_H
+#define MESG_REC_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "hex.h"
+
+/*
+ * One ISOBUS message, independent of how it is framed for a client
+ *
+ * This is also how messages are kept in the ring buffer and the log. The
+ * size is a power of two, so records never straddle the end of the buffer.
+ * Only 8 byte alignment is needed, so records in the log (which are only
+ * aligned that far) can be read where they are. Clients are sent the low 32
+ * bits of the ID.
+ */
+struct mesg_rec {
+	uint64_t id;
+	uint32_t pgn;
+	uint32_t tv_sec;
+	uint32_t tv_usec;
+	uint8_t iface;
+	uint8_t daddr;
+	uint8_t saddr;
+	uint8_t dlen;
+	uint8_t data[8];
+};
+_Static_assert(sizeof(struct mesg_rec) == 32, "mesg_rec must stay 32 bytes");
+
+/* Length of a hex record without data bytes (but with its newline) */
+#define HEX_MESG_FIXED	(1 + 8 + 5 + 2 + 4 + 8 + 5 + 2 + 1)
+/* Longest hex record, opcode included */
+#define HEX_MESG_MAX	(1 + HEX_MESG_FIXED + 2 * 8)
+
+/* Function to print a message record in the hex format */
+static inline char *hex_mesg(char *cp, char op, const struct mesg_rec *r)
+{
+	/* Print opcode (1 char) */
+	*(cp++) = op;
+	/* Print CAN interface index (1 nibble) */
+	cp = hex_val(cp, r->iface, 1);
+	/* Print DB key */
+	cp = hex_val(cp, r->id, 8);
+	/* Print PGN (5 nibbles) */
+	cp = hex_val(cp, r->pgn, 5);
+	/* Print destination address (2 nibbles) */
+	cp = hex_byte(cp, r->daddr);
+	/* Print data bytes (4 nibbles length) */
+	cp = hex_val(cp, r->dlen, 4);
+	hex_bytes8(cp, r->data);
+	cp += 2 * r->dlen;
+	/* Print timestamp (8 nibbles sec, 5 nibbles usec) */
+	cp = hex_val(cp, r->tv_sec, 8);
+	cp = hex_val(cp, r->tv_usec, 5);
+	/* Print source address (2 nibbles) */
+	cp = hex_byte(cp, r->saddr);
+	/* Print message ending */
+	*(cp++) = '\n';
+
+	return cp;
+}
+
+/*
+ * Function to parse a stored hex record (without its opcode)
+ *
+ * Returns false if it is the wrong length or has anything but hex digits.
+ */
+static inline bool parse_mesg(const char *cp, size_t len, struct mesg_rec *r)
+{
+	uint32_t iface, id, daddr, dlen, saddr;
+
+	if(len < HEX_MESG_FIXED || hex_get(cp, 1, &iface) < 0 ||
+			hex_get(cp + 1, 8, &id) < 0 ||
+			hex_get(cp + 9, 5, &r->pgn) < 0 ||
+			hex_get(cp + 14, 2, &daddr) < 0 ||
+			hex_get(cp + 16, 4, &dlen) < 0)
+		return false;
+	if(dlen > sizeof(r->data) || len != HEX_MESG_FIXED + 2 * (size_t)dlen)
+		return false;
+	cp += 20;
+	if(hex_get_bytes(cp, r->data, dlen) < 0)
+		return false;
+	cp += 2 * dlen;
+	if(hex_get(cp, 8, &r->tv_sec) < 0 || hex_get(cp + 8, 5, &r->tv_usec) < 0 ||
+			hex_get(cp + 13, 2, &saddr) < 0)
+		return false;
+	r->iface = iface;
+	r->id = id;
+	r->daddr = daddr;
+	r->dlen = dlen;
+	r->saddr = saddr;
+
+	return true;
+}
+
+/* Little-endian helpers for the binary format */
+static inline char *put_le16(char *cp, uint16_t val)
+{
+	*(cp++) = val;
+	*(cp++) = val >> 8;
+
+	return cp;
+}
+static inline char *put_le32(char *cp, uint32_t val)
+{
+	*(cp++) = val;
+	*(cp++) = val >> 8;
+	*(cp++) = val >> 16;
+	*(cp++) = val >> 24;
+
+	return cp;
+}
+
+/*
+ * Function to print a message record in the binary format
+ *
+ * Every field is fixed width and little-endian:
+ * opcode (1), interface (1), db key (4), PGN (4), DA (1), SA (1),
+ * length (2), data bytes (length), timestamp sec (4), timestamp usec (4)
+ */
+static inline char *bin_mesg(char *cp, char op, const struct mesg_rec *r)
+{
+	*(cp++) = op;
+	*(cp++) = r->iface;
+	cp = put_le32(cp, r->id);
+	cp = put_le32(cp, r->pgn);
+	*(cp++) = r->daddr;
+	*(cp++) = r->saddr;
+	cp = put_le16(cp, r->dlen);
+	memcpy(cp, r->data, r->dlen);
+	cp += r->dlen;
+	cp = put_le32(cp, r->tv_sec);
+	cp = put_le32(cp, r->tv_usec);
+
+	return cp;
+}
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif /* MESG_REC_H */
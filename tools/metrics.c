@@ -0,0 +1,110 @@
+/*
+ * Metrics Library
+ *
+ *
+ * Author: agent <agent@local>
+ *
+ * Copyright (C) 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "metrics.h"
+
+/* Starts writing beside path, so readers never see a partial file */
+int metrics_begin(struct metrics_file *mf, const char *path)
+{
+	size_t len = strlen(path);
+
+	if(!(mf->tmp = malloc(len + sizeof(".tmp"))))
+		return -1;
+	memcpy(mf->tmp, path, len);
+	memcpy(mf->tmp + len, ".tmp", sizeof(".tmp"));
+	mf->path = path;
+
+	if(!(mf->f = fopen(mf->tmp, "w"))) {
+		free(mf->tmp);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Finishes the file and puts it in place of the last one */
+int metrics_end(struct metrics_file *mf)
+{
+	int err;
+
+	err = ferror(mf->f);
+	err |= fclose(mf->f);
+	if(!err)
+		err = rename(mf->tmp, mf->path);
+	if(err)
+		unlink(mf->tmp);
+	free(mf->tmp);
+
+	return err ? -1 : 0;
+}
+
+void metrics_type(struct metrics_file *mf, const char *name,
+		const char *type, const char *help)
+{
+	fprintf(mf->f, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+void metrics_count(struct metrics_file *mf, const char *name,
+		const char *labels, unsigned long long val)
+{
+	fprintf(mf->f, "%s%s %llu\n", name, labels ? labels : "", val);
+}
+
+void metrics_gauge(struct metrics_file *mf, const char *name,
+		const char *labels, double val)
+{
+	fprintf(mf->f, "%s%s %.6g\n", name, labels ? labels : "", val);
+}
+
+/* Buckets are cumulative, up to the last one used */
+void metrics_hist(struct metrics_file *mf, const char *name,
+		const char *help, const struct metrics_hist *h)
+{
+	unsigned long long cum = 0;
+	int i, last;
+
+	metrics_type(mf, name, "histogram", help);
+
+	for(last = METRICS_HIST_BUCKETS - 1; last > 0; last--) {
+		if(metrics_get(&h->buckets[last]))
+			break;
+	}
+	for(i = 0; i <= last && i < METRICS_HIST_BUCKETS - 1; i++) {
+		cum += metrics_get(&h->buckets[i]);
+		fprintf(mf->f, "%s_bucket{le=\"%llu\"} %llu\n", name,
+				(1ULL << i) - 1, cum);
+	}
+	fprintf(mf->f, "%s_bucket{le=\"+Inf\"} %llu\n", name,
+			metrics_get(&h->count));
+	fprintf(mf->f, "%s_sum %llu\n%s_count %llu\n", name,
+			metrics_get(&h->sum), name, metrics_get(&h->count));
+}
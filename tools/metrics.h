@@ -0,0 +1,106 @@
+/*
+ * Metrics Library
+ *
+ * Counters and log2 histograms for watching a program while it runs. Each is
+ * only ever changed by one thread, so updates are plain relaxed loads and
+ * stores, yet other threads can still read them whole. They are written out
+ * in the Prometheus text format, to a file replaced whole each time, for a
+ * collector (or a person) to read.
+ *
+ *
+ * Author: agent <agent@local>
+ *
+ * Copyright (C) 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include <stdio.h>
+#include <stdatomic.h>
+
+/* Bucket i counts values below 2^i (and at least 2^(i-1)), the last the rest */
+#define METRICS_HIST_BUCKETS	32
+
+struct metrics_hist
+{
+	atomic_ullong count;
+	atomic_ullong sum;
+	atomic_ullong buckets[METRICS_HIST_BUCKETS];
+};
+
+/* File being written, which replaces path once done */
+struct metrics_file
+{
+	FILE *f;
+	const char *path;
+	char *tmp;
+};
+
+int metrics_begin(struct metrics_file *mf, const char *path);
+int metrics_end(struct metrics_file *mf);
+
+void metrics_type(struct metrics_file *mf, const char *name,
+		const char *type, const char *help);
+void metrics_count(struct metrics_file *mf, const char *name,
+		const char *labels, unsigned long long val);
+void metrics_gauge(struct metrics_file *mf, const char *name,
+		const char *labels, double val);
+void metrics_hist(struct metrics_file *mf, const char *name,
+		const char *help, const struct metrics_hist *h);
+
+/* Function to add to a value only the calling thread changes */
+static inline void metrics_add(atomic_ullong *val, unsigned long long n)
+{
+	atomic_store_explicit(val, n +
+			atomic_load_explicit(val, memory_order_relaxed),
+			memory_order_relaxed);
+}
+
+/* Function to read a value another thread may be changing */
+static inline unsigned long long metrics_get(const atomic_ullong *val)
+{
+	return atomic_load_explicit((atomic_ullong *)val, memory_order_relaxed);
+}
+
+/* Function to count a value in a histogram only the calling thread changes */
+static inline void metrics_hist_add(struct metrics_hist *h,
+		unsigned long long val)
+{
+	int i = val ? 64 - __builtin_clzll(val) : 0;
+
+	if(i >= METRICS_HIST_BUCKETS) {
+		i = METRICS_HIST_BUCKETS - 1;
+	}
+	metrics_add(&h->buckets[i], 1);
+	metrics_add(&h->count, 1);
+	metrics_add(&h->sum, val);
+}
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif /* METRICS_H */
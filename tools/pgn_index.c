@@ -0,0 +1,253 @@
+/*
+ * PGN Index Library
+ *
+ *
+ * Author: agent <agent@local>
+ *
+ * Copyright (C) 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+
+#include "pgn_index.h"
+
+/*
+ * Ordering of every key in stores from before IDs were 64-bit ("isoblued.v1"),
+ * needed to open them to move them over
+ *
+ * Messages (native 32-bit IDs) come first, in ID order, then index entries
+ * in byte order.
+ */
+int pgn_index_compare_v1(const char *a, size_t alen, const char *b,
+		size_t blen)
+{
+	int cmp;
+
+	if(alen == sizeof(uint32_t) && blen == sizeof(uint32_t)) {
+		uint32_t ida, idb;
+
+		memcpy(&ida, a, sizeof(ida));
+		memcpy(&idb, b, sizeof(idb));
+		return (ida > idb) - (ida < idb);
+	}
+	if(alen == sizeof(uint32_t))
+		return -1;
+	if(blen == sizeof(uint32_t))
+		return 1;
+
+	cmp = memcmp(a, b, alen < blen ? alen : blen);
+	return cmp ? cmp : (alen > blen) - (alen < blen);
+}
+
+static inline void _pgn_index_key(char *key, uint32_t pgn, uint64_t id)
+{
+	key[0] = PGN_INDEX_TAG;
+	key[1] = pgn >> 24;
+	key[2] = pgn >> 16;
+	key[3] = pgn >> 8;
+	key[4] = pgn;
+	pgn_index_put_id(key + 5, id);
+}
+
+static inline uint32_t _pgn_index_key_pgn(const char *key)
+{
+	const unsigned char *k = (const unsigned char *)key;
+
+	return (uint32_t)k[1] << 24 | k[2] << 16 | k[3] << 8 | k[4];
+}
+
+static inline uint64_t _pgn_index_key_id(const char *key)
+{
+	return pgn_index_get_id(key + 5);
+}
+
+int pgn_index_batch_create(struct pgn_index_batch *batch, size_t cap)
+{
+	batch->pairs = malloc(cap * sizeof(*batch->pairs));
+	batch->deltas = malloc(cap * sizeof(*batch->deltas));
+	batch->count = 0;
+	batch->cap = cap;
+
+	return batch->pairs && batch->deltas ? 0 : -1;
+}
+
+void pgn_index_batch_free(struct pgn_index_batch *batch)
+{
+	free(batch->pairs);
+	free(batch->deltas);
+}
+
+static int _pgn_index_pair_cmp(const void *a, const void *b)
+{
+	const struct pgn_index_pair *pa = a, *pb = b;
+
+	if(pa->pgn != pb->pgn)
+		return pa->pgn < pb->pgn ? -1 : 1;
+	return (pa->id > pb->id) - (pa->id < pb->id);
+}
+
+/*
+ * Writes one entry per PGN in the batch, holding all its IDs
+ *
+ * A batch spans far fewer than 2^32 IDs, so each fits as a 32-bit distance
+ * back from the entry's last ID.
+ */
+void pgn_index_batch_flush(struct pgn_index_batch *batch,
+		leveldb_writebatch_t *wb)
+{
+	char key[PGN_INDEX_KEY_LEN];
+	uint64_t last;
+	size_t i, j, n;
+
+	qsort(batch->pairs, batch->count, sizeof(*batch->pairs),
+			_pgn_index_pair_cmp);
+
+	for(i = 0; i < batch->count; i += n) {
+		for(n = 0; i + n < batch->count &&
+				batch->pairs[i+n].pgn == batch->pairs[i].pgn; n++)
+			;
+		last = batch->pairs[i+n-1].id;
+		for(j = 0; j < n; j++)
+			batch->deltas[j] = last - batch->pairs[i+j].id;
+
+		_pgn_index_key(key, batch->pairs[i].pgn, last);
+		leveldb_writebatch_put(wb, key, sizeof(key), (char *)batch->deltas,
+				n * sizeof(*batch->deltas));
+	}
+
+	batch->count = 0;
+}
+
+/* Loads the entry the iterator is on, or ends the cursor */
+static void _pgn_index_cursor_load(struct pgn_index_cursor *cur)
+{
+	const char *key;
+	size_t len;
+
+	if(leveldb_iter_valid(cur->iter)) {
+		key = leveldb_iter_key(cur->iter, &len);
+		if(len == PGN_INDEX_KEY_LEN && key[0] == PGN_INDEX_TAG &&
+				_pgn_index_key_pgn(key) == cur->pgn) {
+			cur->last = _pgn_index_key_id(key);
+			cur->deltas = leveldb_iter_value(cur->iter, &len);
+			cur->count = len / sizeof(uint32_t);
+			cur->i = 0;
+			if(cur->count)
+				return;
+		}
+	}
+
+	pgn_index_cursor_close(cur);
+}
+
+/* Positions a cursor at the first ID at or after start */
+void pgn_index_cursor_open(struct pgn_index_cursor *cur, leveldb_t *db,
+		const leveldb_readoptions_t *options, uint32_t pgn, uint64_t start)
+{
+	char key[PGN_INDEX_KEY_LEN];
+
+	cur->pgn = pgn;
+	cur->iter = leveldb_create_iterator(db, options);
+
+	/* First entry which ends at or after start */
+	_pgn_index_key(key, pgn, start);
+	leveldb_iter_seek(cur->iter, key, sizeof(key));
+	_pgn_index_cursor_load(cur);
+
+	while(cur->iter && pgn_index_cursor_id(cur) < start)
+		pgn_index_cursor_next(cur);
+}
+
+void pgn_index_cursor_next(struct pgn_index_cursor *cur)
+{
+	if(++cur->i < cur->count)
+		return;
+
+	leveldb_iter_next(cur->iter);
+	_pgn_index_cursor_load(cur);
+}
+
+void pgn_index_cursor_close(struct pgn_index_cursor *cur)
+{
+	if(cur->iter) {
+		leveldb_iter_destroy(cur->iter);
+		cur->iter = NULL;
+	}
+}
+
+/*
+ * Deletes the entries only listing IDs before the given one, batch at a time
+ *
+ * A PGN's entries are in ID order, so once one is kept the rest of that
+ * PGN is skipped over. Returns the number of entries deleted, or -1.
+ */
+long pgn_index_trim(leveldb_t *db, const leveldb_readoptions_t *roptions,
+		const leveldb_writeoptions_t *woptions, uint64_t before, size_t batch)
+{
+	leveldb_iterator_t *iter;
+	leveldb_writebatch_t *wb;
+	char key[PGN_INDEX_KEY_LEN], *err = NULL;
+	const char *k;
+	size_t len, n = 0;
+	long deleted = 0;
+	uint32_t pgn;
+
+	iter = leveldb_create_iterator(db, roptions);
+	wb = leveldb_writebatch_create();
+
+	_pgn_index_key(key, 0, 0);
+	leveldb_iter_seek(iter, key, sizeof(key));
+	while(!err && leveldb_iter_valid(iter)) {
+		k = leveldb_iter_key(iter, &len);
+		if(len != PGN_INDEX_KEY_LEN || k[0] != PGN_INDEX_TAG)
+			break;
+		pgn = _pgn_index_key_pgn(k);
+
+		if(_pgn_index_key_id(k) >= before) {
+			if(pgn == UINT32_MAX)
+				break;
+			_pgn_index_key(key, pgn + 1, 0);
+			leveldb_iter_seek(iter, key, sizeof(key));
+			continue;
+		}
+
+		leveldb_writebatch_delete(wb, k, len);
+		deleted++;
+		if(++n == batch) {
+			leveldb_write(db, woptions, wb, &err);
+			leveldb_writebatch_clear(wb);
+			n = 0;
+		}
+		leveldb_iter_next(iter);
+	}
+	if(!err && n)
+		leveldb_write(db, woptions, wb, &err);
+
+	leveldb_writebatch_destroy(wb);
+	leveldb_iter_destroy(iter);
+
+	if(err) {
+		leveldb_free(err);
+		return -1;
+	}
+
+	return deleted;
+}
@@ -0,0 +1,143 @@
+/*
+ * PGN Index Library
+ *
+ * Secondary index of the isoblued message store, listing the IDs of the
+ * messages stored for each PGN. Messages are keyed by their 64-bit ID,
+ * big-endian, so LevelDB's own byte order is ID order. Index entries live in
+ * the same LevelDB as the messages, written in the same batches, under keys
+ * that sort after every message:
+ * 'p', PGN (4 bytes big-endian), last ID in the entry (8 bytes big-endian)
+ * Each entry's value is its sorted list of IDs, each as how far it is before
+ * the last one, a native 32-bit integer.
+ *
+ *
+ * Author: agent <agent@local>
+ *
+ * Copyright (C) 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef PGN_INDEX_H
+#define PGN_INDEX_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <leveldb/c.h>
+
+#define PGN_INDEX_TAG	'p'
+#define PGN_INDEX_KEY_LEN	13
+/* Length of a message's key */
+#define PGN_INDEX_ID_LEN	8
+/* ID of a cursor with no more messages */
+#define PGN_INDEX_END	UINT64_MAX
+
+/* Index entries waiting to go into a write batch */
+struct pgn_index_batch
+{
+	struct pgn_index_pair {
+		uint32_t pgn;
+		uint64_t id;
+	} *pairs;
+	uint32_t *deltas;
+	size_t count;
+	size_t cap;
+};
+
+/* Position in the IDs stored for one PGN */
+struct pgn_index_cursor
+{
+	leveldb_iterator_t *iter;
+	uint32_t pgn;
+	uint64_t last;
+	const char *deltas;
+	size_t count;
+	size_t i;
+};
+
+/* Writes the key of a message, its ID big-endian */
+static inline void pgn_index_put_id(char *key, uint64_t id)
+{
+	int i;
+
+	for(i = PGN_INDEX_ID_LEN - 1; i >= 0; i--, id >>= 8)
+		key[i] = id;
+}
+
+/* Reads the ID from the key of a message */
+static inline uint64_t pgn_index_get_id(const char *key)
+{
+	const unsigned char *k = (const unsigned char *)key;
+	uint64_t id = 0;
+	int i;
+
+	for(i = 0; i < PGN_INDEX_ID_LEN; i++)
+		id = id << 8 | k[i];
+
+	return id;
+}
+
+int pgn_index_compare_v1(const char *a, size_t alen, const char *b,
+		size_t blen);
+
+int pgn_index_batch_create(struct pgn_index_batch *batch, size_t cap);
+void pgn_index_batch_free(struct pgn_index_batch *batch);
+void pgn_index_batch_flush(struct pgn_index_batch *batch,
+		leveldb_writebatch_t *wb);
+
+/* Adds a message, flushing into wb when the batch is full */
+static inline void pgn_index_batch_add(struct pgn_index_batch *batch,
+		leveldb_writebatch_t *wb, uint32_t pgn, uint64_t id)
+{
+	batch->pairs[batch->count].pgn = pgn;
+	batch->pairs[batch->count].id = id;
+	if(++batch->count == batch->cap)
+		pgn_index_batch_flush(batch, wb);
+}
+
+long pgn_index_trim(leveldb_t *db, const leveldb_readoptions_t *roptions,
+		const leveldb_writeoptions_t *woptions, uint64_t before, size_t batch);
+
+void pgn_index_cursor_open(struct pgn_index_cursor *cur, leveldb_t *db,
+		const leveldb_readoptions_t *options, uint32_t pgn, uint64_t start);
+void pgn_index_cursor_next(struct pgn_index_cursor *cur);
+void pgn_index_cursor_close(struct pgn_index_cursor *cur);
+
+static inline uint64_t pgn_index_cursor_id(const struct pgn_index_cursor *cur)
+{
+	uint32_t delta;
+
+	if(!cur->iter)
+		return PGN_INDEX_END;
+
+	memcpy(&delta, cur->deltas + cur->i * sizeof(delta), sizeof(delta));
+	return cur->last - delta;
+}
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif /* PGN_INDEX_H */
@@ -0,0 +1,180 @@
+/*
+ * PGN index benchmark
+ *
+ * Builds a message store laid out like isoblued's, then times finding every
+ * message of one PGN by scanning all of them and by using the PGN index.
+ *
+ *
+ * Author: agent <agent@local>
+ *
+ * Copyright (C) 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <leveldb/c.h>
+
+#include "hex.h"
+#include "mesg_rec.h"
+#include "pgn_index.h"
+#include "bench.h"
+
+#define DB_PATH	"pgn_index_bench_db"
+
+#define PGNS_DEF	64
+
+/* Offset of the PGN in a stored record (opcode, interface, ID) */
+#define VAL_PGN	(1 + 1 + 8)
+
+static uint32_t val_pgn(const char *val)
+{
+	uint32_t pgn;
+
+	hex_get(val + VAL_PGN, 5, &pgn);
+
+	return pgn;
+}
+
+int main(int argc, char *argv[])
+{
+	leveldb_t *db;
+	leveldb_options_t *options;
+	leveldb_writeoptions_t *woptions;
+	leveldb_readoptions_t *roptions;
+	leveldb_writebatch_t *wb;
+	leveldb_iterator_t *iter;
+	struct pgn_index_batch batch;
+	struct pgn_index_cursor cur;
+	char *err = NULL;
+	char key[PGN_INDEX_ID_LEN];
+	uint32_t nrecs, npgns, id, pgn;
+	uint64_t index_id;
+	unsigned long long found_scan, found_index;
+	double start, t_scan, t_index;
+	size_t len;
+
+	if(argc > 3) {
+		fprintf(stderr, "usage: pgn_index_bench [RECORDS [PGNS]]\n");
+		return EXIT_FAILURE;
+	}
+	nrecs = argc > 1 ? strtoul(argv[1], NULL, 0) : BENCH_RECS_DEF;
+	npgns = argc > 2 ? strtoul(argv[2], NULL, 0) : PGNS_DEF;
+	if(nrecs < 1 || npgns < 1) {
+		fprintf(stderr, "RECORDS and PGNS must be positive\n");
+		return EXIT_FAILURE;
+	}
+
+	options = leveldb_options_create();
+	leveldb_options_set_create_if_missing(options, 1);
+	leveldb_destroy_db(options, DB_PATH, &err);
+	bench_check(err, "leveldb_destroy_db");
+	db = leveldb_open(options, DB_PATH, &err);
+	bench_check(err, "leveldb_open");
+	woptions = leveldb_writeoptions_create();
+	roptions = leveldb_readoptions_create();
+	leveldb_readoptions_set_fill_cache(roptions, 0);
+	wb = leveldb_writebatch_create();
+	if(pgn_index_batch_create(&batch, 4096) < 0) {
+		perror("pgn_index_batch_create");
+		return EXIT_FAILURE;
+	}
+
+	/* Fill the store with messages spread evenly over the PGNs */
+	printf("storing %u messages over %u PGNs\n", nrecs, npgns);
+	srand(1);
+	start = bench_now();
+	for(id = 1; id <= nrecs; id++) {
+		struct mesg_rec r;
+		char val[HEX_MESG_MAX], *cp;
+
+		bench_mesg(&r, id, 0xFE00 + rand() % npgns);
+		cp = hex_mesg(val, 'M', &r);
+
+		pgn_index_put_id(key, id);
+		leveldb_writebatch_put(wb, key, sizeof(key), val, cp - val);
+		pgn_index_batch_add(&batch, wb, r.pgn, id);
+		if(id % BENCH_COMMIT_COUNT == 0 || id == nrecs) {
+			pgn_index_batch_flush(&batch, wb);
+			leveldb_write(db, woptions, wb, &err);
+			bench_check(err, "leveldb_write");
+			leveldb_writebatch_clear(wb);
+		}
+	}
+	printf("stored in %.2f s\n", bench_now() - start);
+
+	/* Find the first PGN's messages by decoding every value */
+	pgn = 0xFE00;
+	found_scan = 0;
+	pgn_index_put_id(key, 1);
+	start = bench_now();
+	iter = leveldb_create_iterator(db, roptions);
+	for(leveldb_iter_seek(iter, key, sizeof(key));
+			leveldb_iter_valid(iter); leveldb_iter_next(iter)) {
+		const char *val;
+
+		leveldb_iter_key(iter, &len);
+		if(len != sizeof(key))
+			break;
+		val = leveldb_iter_value(iter, &len);
+		if(val_pgn(val) == pgn)
+			found_scan++;
+	}
+	t_scan = bench_now() - start;
+
+	/* Find them again through the index, reading only their values */
+	found_index = 0;
+	start = bench_now();
+	pgn_index_cursor_open(&cur, db, roptions, pgn, 1);
+	for(; (index_id = pgn_index_cursor_id(&cur)) != PGN_INDEX_END;
+			pgn_index_cursor_next(&cur)) {
+		pgn_index_put_id(key, index_id);
+		leveldb_iter_seek(iter, key, sizeof(key));
+		if(leveldb_iter_valid(iter) &&
+				val_pgn(leveldb_iter_value(iter, &len)) == pgn)
+			found_index++;
+	}
+	pgn_index_cursor_close(&cur);
+	t_index = bench_now() - start;
+	leveldb_iter_destroy(iter);
+
+	printf("scan:  %llu messages of PGN %05x in %.3f s (%.0f scanned/s)\n",
+			found_scan, pgn, t_scan, nrecs / t_scan);
+	printf("index: %llu messages of PGN %05x in %.3f s (%.1fx)\n",
+			found_index, pgn, t_index, t_scan / t_index);
+
+	leveldb_close(db);
+	leveldb_destroy_db(options, DB_PATH, &err);
+	pgn_index_batch_free(&batch);
+	leveldb_writebatch_destroy(wb);
+	leveldb_readoptions_destroy(roptions);
+	leveldb_writeoptions_destroy(woptions);
+	leveldb_options_destroy(options);
+
+	if(found_scan != found_index) {
+		fprintf(stderr, "scan and index disagree\n");
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,134 @@
+/*
+ * Event Loop Library
+ *
+ *
+ * Author: agent <agent@local>
+ *
+ * Copyright (C) 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <sys/epoll.h>
+
+#include "reactor.h"
+
+/* Most events handled per reactor_wait */
+#define REACTOR_EVENTS	32
+
+int reactor_create(struct reactor *reactor)
+{
+	reactor->epfd = epoll_create1(EPOLL_CLOEXEC);
+
+	return reactor->epfd;
+}
+
+int reactor_free(struct reactor *reactor)
+{
+	return close(reactor->epfd);
+}
+
+static inline uint32_t _reactor_events(bool want_write)
+{
+	return want_write ? EPOLLIN | EPOLLOUT : EPOLLIN;
+}
+
+int reactor_add(struct reactor *reactor, struct reactor_handler *handler,
+		bool want_write)
+{
+	struct epoll_event ev = { 0 };
+
+	ev.events = handler->events = _reactor_events(want_write);
+	ev.data.ptr = handler;
+
+	return epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, handler->fd, &ev);
+}
+
+int reactor_del(struct reactor *reactor, struct reactor_handler *handler)
+{
+	handler->events = 0;
+
+	return epoll_ctl(reactor->epfd, EPOLL_CTL_DEL, handler->fd, NULL);
+}
+
+/* Only talks to the kernel when interest actually changes */
+static int _reactor_mod(struct reactor *reactor,
+		struct reactor_handler *handler, uint32_t events)
+{
+	struct epoll_event ev = { 0 };
+
+	if(events == handler->events)
+		return 0;
+
+	handler->events = ev.events = events;
+	ev.data.ptr = handler;
+
+	return epoll_ctl(reactor->epfd, EPOLL_CTL_MOD, handler->fd, &ev);
+}
+
+int reactor_want_write(struct reactor *reactor,
+		struct reactor_handler *handler, bool want_write)
+{
+	return _reactor_mod(reactor, handler,
+			(handler->events & EPOLLIN) | (want_write ? EPOLLOUT : 0));
+}
+
+/* Hang ups and errors still call the read function while reads are unwanted */
+int reactor_want_read(struct reactor *reactor,
+		struct reactor_handler *handler, bool want_read)
+{
+	return _reactor_mod(reactor, handler,
+			(handler->events & EPOLLOUT) | (want_read ? EPOLLIN : 0));
+}
+
+/* Returns number of events handled, 0 on timeout/signal, or < 0 on error */
+int reactor_wait(struct reactor *reactor, int timeout)
+{
+	struct epoll_event evs[REACTOR_EVENTS];
+	int i, n;
+
+	if((n = epoll_wait(reactor->epfd, evs, REACTOR_EVENTS, timeout)) < 0) {
+		if(errno == EINTR)
+			return 0;
+
+		perror("epoll_wait");
+		return n;
+	}
+
+	for(i = 0; i < n; i++) {
+		struct reactor_handler *handler = evs[i].data.ptr;
+		const struct reactor_ops *ops = handler->ops;
+		int ret = 0;
+
+		if(ops->read && (evs[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+			ret = ops->read(reactor, handler);
+
+		if(ret >= 0 && ops->write && (evs[i].events & EPOLLOUT))
+			ret = ops->write(reactor, handler);
+
+		if(ret < 0 && ops->close)
+			ops->close(reactor, handler);
+	}
+
+	return n;
+}
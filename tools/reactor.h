@@ -0,0 +1,85 @@
+/*
+ * Event Loop Library
+ *
+ * Small epoll based reactor, dispatching events to per fd handlers.
+ *
+ *
+ * Author: agent <agent@local>
+ *
+ * Copyright (C) 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define container_of(ptr, type, member) \
+	((type *)((char *)(ptr) - offsetof(type, member)))
+
+struct reactor;
+struct reactor_handler;
+
+/* Handler functions return < 0 to have the handler closed */
+struct reactor_ops
+{
+	int (*read)(struct reactor *reactor, struct reactor_handler *handler);
+	int (*write)(struct reactor *reactor, struct reactor_handler *handler);
+	void (*close)(struct reactor *reactor, struct reactor_handler *handler);
+};
+
+/* Embed in a per fd type struct, and use container_of to get at it */
+struct reactor_handler
+{
+	int fd;
+	const struct reactor_ops *ops;
+
+	/* Events currently registered with epoll */
+	uint32_t events;
+};
+
+struct reactor
+{
+	int epfd;
+};
+
+int reactor_create(struct reactor *reactor);
+int reactor_free(struct reactor *reactor);
+int reactor_add(struct reactor *reactor, struct reactor_handler *handler,
+		bool want_write);
+int reactor_del(struct reactor *reactor, struct reactor_handler *handler);
+int reactor_want_write(struct reactor *reactor,
+		struct reactor_handler *handler, bool want_write);
+int reactor_want_read(struct reactor *reactor,
+		struct reactor_handler *handler, bool want_read);
+int reactor_wait(struct reactor *reactor, int timeout);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif /* REACTOR_H */
@@ -27,6 +27,8 @@
 
 #include <sys/mman.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <unistd.h>
 
 #include <fcntl.h>
@@ -37,14 +39,79 @@
 
 #include "ring_buf.h"
 
-#define FOOTER_LEN	(sizeof(((struct ring_buffer *)0)->tail_offset) + \
-		sizeof(((struct ring_buffer*)0)->head_offset))
+#define FOOTER_MAGIC	0x52494e4742554632ULL
+
+/*
+ * Offsets as of a checkpoint, kept after the data in the file. There are two
+ * copies, written in turn, so one is still whole if we stop part way through
+ * writing the other.
+ */
+struct ring_buffer_footer
+{
+	uint64_t magic;
+	uint64_t seq;
+	uint64_t count_bytes;
+	uint64_t head_offset;
+	uint64_t tail_offset;
+	uint64_t start_offset;
+	uint64_t curs_offset;
+	uint64_t format;
+	uint64_t check;
+};
+
+#define FOOTER_LEN	(2 * sizeof(struct ring_buffer_footer))
 
 static void _ring_buffer_curs_advance(struct ring_buffer *buffer,
 		unsigned long count_bytes);
 static void _ring_buffer_tail_advance(struct ring_buffer *buffer,
 		unsigned long count_bytes);
 
+/* FNV-1a hash of a footer copy, up to its check value */
+static uint64_t _ring_buffer_footer_check(const struct ring_buffer_footer *f)
+{
+	const unsigned char *cp = (const unsigned char *)f;
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	size_t i;
+
+	for(i = 0; i < offsetof(struct ring_buffer_footer, check); i++) {
+		hash = (hash ^ cp[i]) * 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
+/* Picks up the offsets of the newest whole checkpoint which fits the buffer */
+static void _ring_buffer_recover(struct ring_buffer *buffer)
+{
+	const struct ring_buffer_footer *f, *best = NULL;
+	int i;
+
+	for(i = 0; i < 2; i++) {
+		f = &buffer->footer[i];
+		if(f->magic != FOOTER_MAGIC || f->count_bytes != buffer->count_bytes ||
+				f->check != _ring_buffer_footer_check(f))
+			continue;
+		if(f->head_offset >= f->count_bytes ||
+				f->tail_offset >= f->count_bytes ||
+				f->start_offset >= f->count_bytes ||
+				f->curs_offset >= f->count_bytes)
+			continue;
+		if(!best || f->seq > best->seq)
+			best = f;
+	}
+
+	if(!best)
+		return;
+
+	buffer->head_offset = best->head_offset;
+	buffer->tail_offset = best->tail_offset;
+	buffer->start_offset = best->start_offset;
+	buffer->curs_offset = best->curs_offset;
+	buffer->format = best->format;
+	buffer->footer_seq = best->seq;
+	buffer->recovered = 1;
+}
+
 //Warning order should be at least 12 for Linux
 int ring_buffer_create(struct ring_buffer *buffer, unsigned long order,
 		char path[])
@@ -57,16 +124,17 @@ int ring_buffer_create(struct ring_buffer *buffer, unsigned long order,
 		return buffer->fd;
 
 	buffer->count_bytes = 1UL << order;
+	buffer->record_bytes = 1;
 
 	status = ftruncate(buffer->fd, buffer->count_bytes + FOOTER_LEN);
 	if(status)
 		return status;
 
-	//lseek(buffer->fd, -FOOTER_LEN, SEEK_END);
-	//read(buffer->fd, &buffer->head_offset, sizeof(buffer->head_offset));
-	//read(buffer->fd, &buffer->tail_offset, sizeof(buffer->tail_offset));
 	buffer->start_offset = buffer->head_offset = 0;
 	buffer->curs_offset = buffer->tail_offset = 0;
+	buffer->footer_seq = 0;
+	buffer->recovered = 0;
+	buffer->format = 0;
 
 	buffer->address = mmap(NULL, buffer->count_bytes << 1, PROT_NONE,
 						   MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
@@ -87,6 +155,15 @@ int ring_buffer_create(struct ring_buffer *buffer, unsigned long order,
 	if(address != buffer->address + buffer->count_bytes)
 		return -1;
 
+	/* count_bytes is a multiple of the page size, so this can be mapped */
+	buffer->footer = mmap(NULL, FOOTER_LEN, PROT_READ | PROT_WRITE, MAP_SHARED,
+			buffer->fd, buffer->count_bytes);
+
+	if(buffer->footer == MAP_FAILED)
+		return -1;
+
+	_ring_buffer_recover(buffer);
+
 	/* pthread_cond_init(&buffer->unread_cond, NULL); */
 	/* pthread_mutex_init(&buffer->unread_mut, NULL); */
 
@@ -105,11 +182,49 @@ int ring_buffer_free(struct ring_buffer *buffer)
 {
 	int status;
 
-	status = munmap(buffer->address, buffer->count_bytes << 1);
+	status = ring_buffer_checkpoint(buffer, MS_SYNC);
+	status |= munmap(buffer->footer, FOOTER_LEN);
+	status |= munmap(buffer->address, buffer->count_bytes << 1);
 
 	return status | close(buffer->fd);
 }
 
+/*
+ * Saves the offsets in the file, so ring_buffer_create can pick them up again.
+ * flags are passed on to msync (MS_ASYNC or MS_SYNC), to get the data and the
+ * offsets to disk; with 0 they are only as safe as the page cache.
+ *
+ * Only MS_SYNC gets the data there before the offsets. MS_ASYNC just starts
+ * writeback, so after a power loss the offsets may cover data which never
+ * made it; users have to check what they find there (isoblued checks that
+ * record IDs run on).
+ */
+int ring_buffer_checkpoint(struct ring_buffer *buffer, int flags)
+{
+	struct ring_buffer_footer *f;
+
+	/* Data first; with MS_SYNC, the offsets never cover data not there */
+	if(flags && msync(buffer->address, buffer->count_bytes, flags))
+		return -1;
+
+	buffer->footer_seq++;
+	f = &buffer->footer[buffer->footer_seq & 1];
+	f->magic = FOOTER_MAGIC;
+	f->seq = buffer->footer_seq;
+	f->count_bytes = buffer->count_bytes;
+	f->head_offset = buffer->head_offset;
+	f->tail_offset = buffer->tail_offset;
+	f->start_offset = buffer->start_offset;
+	f->curs_offset = buffer->curs_offset;
+	f->format = buffer->format;
+	f->check = _ring_buffer_footer_check(f);
+
+	if(flags && msync(buffer->footer, FOOTER_LEN, flags))
+		return -1;
+
+	return 0;
+}
+
 void *ring_buffer_head_address(struct ring_buffer *buffer)
 {
 	return buffer->address + buffer->head_offset;
@@ -130,9 +245,6 @@ void ring_buffer_head_advance(struct ring_buffer *buffer,
 
 	buffer->head_offset += count_bytes;
 	buffer->head_offset = _buf_mod(buffer, buffer->head_offset);
-
-	//lseek(buffer->fd, -FOOTER_LEN, SEEK_END);
-	//write(buffer->fd, &buffer->head_offset, sizeof(buffer->head_offset));
 }
 
 void *ring_buffer_start_address(struct ring_buffer *buffer)
@@ -198,6 +310,13 @@ void ring_buffer_seek_curs_tail(struct ring_buffer *buffer)
 	/* pthread_cleanup_pop(1); */
 }
 
+/* Puts the cursor count_bytes before the tail */
+void ring_buffer_seek_curs_tail_rewind(struct ring_buffer *buffer,
+		unsigned long count_bytes)
+{
+	buffer->curs_offset = _buf_mod(buffer, buffer->tail_offset - count_bytes);
+}
+
 static inline void _ring_buffer_curs_advance(struct ring_buffer *buffer,
 		unsigned long count_bytes)
 {
@@ -240,16 +359,17 @@ static inline void _ring_buffer_tail_advance(struct ring_buffer *buffer,
 
 	dist = OFF_DIST(buffer, tail_offset, head_offset);
 
-	/* There is a weird egde case when the file is empty... */
-	if(dist && dist < count_bytes)
-		ring_buffer_head_advance(buffer, count_bytes - dist + 1);
+	/*
+	 * Overwrite whole records, keeping one free so a full buffer is not
+	 * mistaken for an empty one (dist is 0 only when empty)
+	 */
+	if(dist && dist <= count_bytes)
+		ring_buffer_head_advance(buffer,
+				count_bytes - dist + buffer->record_bytes);
 
 	buffer->tail_offset += count_bytes;
 	buffer->tail_offset = _buf_mod(buffer, buffer->tail_offset);
 
-	//lseek(buffer->fd, -sizeof(buffer->tail_offset), SEEK_END);
-	//write(buffer->fd, &buffer->tail_offset, sizeof(buffer->tail_offset));
-
 	/* pthread_cond_broadcast(&buffer->unread_cond); */
 }
 
@@ -265,6 +385,14 @@ void ring_buffer_tail_advance(struct ring_buffer *buffer,
 	/* pthread_cleanup_pop(1); */
 }
 
+/* Address of the byte count_bytes before the tail */
+void *ring_buffer_tail_rewind_address(struct ring_buffer *buffer,
+		unsigned long count_bytes)
+{
+	return buffer->address + _buf_mod(buffer,
+			buffer->tail_offset - count_bytes);
+}
+
 unsigned long ring_buffer_filled_bytes(struct ring_buffer *buffer)
 {
 	return _buf_mod(buffer, buffer->tail_offset - buffer->head_offset);
@@ -299,10 +427,6 @@ void ring_buffer_clear(struct ring_buffer *buffer)
 	buffer->start_offset = 0;
 	buffer->curs_offset = 0;
 
-	//lseek(buffer->fd, -FOOTER_LEN, SEEK_END);
-	//write(buffer->fd, &buffer->head_offset, sizeof(buffer->head_offset));
-	//write(buffer->fd, &buffer->tail_offset, sizeof(buffer->tail_offset));
-
 	/* pthread_cond_broadcast(&buffer->unread_cond); */
 }
 
@@ -34,15 +34,27 @@ extern "C" {
 
 /* #include <pthread.h> */
 
+struct ring_buffer_footer;
+
 struct ring_buffer
 {
 	char *address;
 	int fd;
 
+	/* Offsets saved by ring_buffer_checkpoint, after the data in the file */
+	struct ring_buffer_footer *footer;
+	unsigned long footer_seq;
+	/* Whether ring_buffer_create found saved offsets to start from */
+	int recovered;
+	/* Caller's tag for the layout of its records, saved with the offsets */
+	unsigned long format;
+
 	/* pthread_cond_t unread_cond; */
 	/* pthread_mutex_t unread_mut; */
 
 	unsigned long count_bytes;
+	/* Size of the records stored, so overwriting drops only whole ones */
+	unsigned long record_bytes;
 	unsigned long tail_offset;
 	unsigned long head_offset;
 	unsigned long start_offset;
@@ -52,6 +64,7 @@ struct ring_buffer
 int ring_buffer_create(struct ring_buffer *buffer, unsigned long order,
 		char path[]);
 int ring_buffer_free(struct ring_buffer *buffer);
+int ring_buffer_checkpoint(struct ring_buffer *buffer, int flags);
 void *ring_buffer_head_address(struct ring_buffer *buffer);
 void ring_buffer_head_advance(struct ring_buffer *buffer,
 		unsigned long count_bytes);
@@ -64,9 +77,13 @@ void ring_buffer_curs_advance(struct ring_buffer *buffer,
 void *ring_buffer_tail_address(struct ring_buffer *buffer);
 void ring_buffer_tail_advance(struct ring_buffer *buffer,
 		unsigned long count_bytes);
+void *ring_buffer_tail_rewind_address(struct ring_buffer *buffer,
+		unsigned long count_bytes);
 void ring_buffer_seek_curs_head(struct ring_buffer *buffer);
 void ring_buffer_seek_curs_start(struct ring_buffer *buffer);
 void ring_buffer_seek_curs_tail(struct ring_buffer *buffer);
+void ring_buffer_seek_curs_tail_rewind(struct ring_buffer *buffer,
+		unsigned long count_bytes);
 unsigned long ring_buffer_filled_bytes(struct ring_buffer *buffer);
 unsigned long ring_buffer_unread_bytes(struct ring_buffer *buffer);
 void ring_buffer_wait_unread_bytes(struct ring_buffer *buffer);
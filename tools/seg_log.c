@@ -0,0 +1,582 @@
+/*
+ * Segmented Log Library
+ *
+ *
+ * Author: agent <agent@local>
+ *
+ * Copyright (C) 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <sys/mman.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dirent.h>
+
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <inttypes.h>
+
+#include "seg_log.h"
+
+/* Segment files are named after their first ID, in 16 hex digits */
+#define SEG_LOG_NAME_LEN	16
+
+static inline size_t _seg_log_index_ents(size_t size)
+{
+	return size / SEG_LOG_INDEX_EVERY + 1;
+}
+
+/* Maps a segment's file, growing it to size, or of its own size if 0 */
+static void *_seg_log_map(struct seg_log *log, uint64_t base, const char *ext,
+		size_t *size, int flags)
+{
+	char name[SEG_LOG_NAME_LEN + 5];
+	struct stat st;
+	void *addr;
+	int fd, err;
+
+	snprintf(name, sizeof(name), "%016" PRIx64 ".%s", base, ext);
+	fd = openat(log->dirfd, name, O_RDWR | flags, S_IRUSR | S_IWUSR);
+	if(fd < 0)
+		return NULL;
+
+	if(fstat(fd, &st) < 0) {
+		close(fd);
+		return NULL;
+	}
+	if(!*size)
+		*size = st.st_size ? (size_t)st.st_size : log->seg_size;
+	/* Really allocate it, as running out of space writing a map is fatal */
+	if((size_t)st.st_size < *size && (err = posix_fallocate(fd, 0, *size))) {
+		close(fd);
+		errno = err;
+		return NULL;
+	}
+
+	addr = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+
+	return addr == MAP_FAILED ? NULL : addr;
+}
+
+static int _seg_log_map_seg(struct seg_log *log, struct seg_log_seg *seg,
+		int flags)
+{
+	size_t index_size;
+
+	if(!(seg->data = _seg_log_map(log, seg->base, "log", &seg->size, flags)))
+		return -1;
+
+	index_size = _seg_log_index_ents(seg->size) * sizeof(*seg->index);
+	if(!(seg->index = _seg_log_map(log, seg->base, "idx", &index_size,
+					O_CREAT | flags))) {
+		munmap(seg->data, seg->size);
+		seg->data = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+static void _seg_log_unmap_seg(struct seg_log_seg *seg)
+{
+	if(!seg->data)
+		return;
+
+	munmap(seg->data, seg->size);
+	munmap(seg->index, _seg_log_index_ents(seg->size) * sizeof(*seg->index));
+	seg->data = NULL;
+	seg->index = NULL;
+}
+
+static struct seg_log_seg *_seg_log_seg(struct seg_log *log, uint64_t base,
+		size_t size, int flags)
+{
+	struct seg_log_seg *seg;
+
+	if(!(seg = calloc(1, sizeof(*seg))))
+		return NULL;
+
+	seg->base = base;
+	seg->size = size;
+	if(_seg_log_map_seg(log, seg, flags) < 0) {
+		free(seg);
+		return NULL;
+	}
+
+	return seg;
+}
+
+/*
+ * Only the last segment stays mapped, along with any being read, so a long
+ * log does not use up the address space. Both are called with the lock held.
+ */
+static int _seg_log_ref(struct seg_log *log, struct seg_log_seg *seg)
+{
+	if(!seg->data && _seg_log_map_seg(log, seg, 0) < 0)
+		return -1;
+
+	seg->refs++;
+	return 0;
+}
+
+static void _seg_log_unref(struct seg_log *log, struct seg_log_seg *seg)
+{
+	if(--seg->refs || seg == log->last)
+		return;
+
+	_seg_log_unmap_seg(seg);
+	/* Nothing else has it once it is trimmed */
+	if(atomic_load_explicit(&seg->trimmed, memory_order_relaxed))
+		free(seg);
+}
+
+/* Notes a record in the sparse index, if it is the first past a boundary */
+static inline void _seg_log_index(struct seg_log_seg *seg, uint64_t id)
+{
+	if(seg->end >= seg->nindex * SEG_LOG_INDEX_EVERY) {
+		seg->index[seg->nindex].id = id;
+		seg->index[seg->nindex].off = seg->end;
+		seg->nindex++;
+	}
+}
+
+/*
+ * Finds the end of a segment's records, after a crash or otherwise
+ *
+ * Starts from the last index entry which still matches its record, so only
+ * the end of the segment is read. Returns the last ID in it, or 0.
+ */
+static uint64_t _seg_log_recover(struct seg_log_seg *seg)
+{
+	const struct seg_log_rec *rec;
+	size_t n, cap = _seg_log_index_ents(seg->size);
+	uint64_t last = 0;
+
+	for(n = 0; n < cap && seg->index[n].id; n++)
+		;
+	for(seg->nindex = n; seg->nindex; seg->nindex--) {
+		const struct seg_log_ent *ent = &seg->index[seg->nindex - 1];
+
+		if(ent->off < seg->size - sizeof(*rec) &&
+				((struct seg_log_rec *)(seg->data + ent->off))->id == ent->id)
+			break;
+	}
+
+	/* Walk from there, indexing again as it goes */
+	if(seg->nindex) {
+		seg->nindex--;
+		seg->end = seg->index[seg->nindex].off;
+	}
+	while(seg->end + sizeof(*rec) <= seg->size) {
+		rec = (struct seg_log_rec *)(seg->data + seg->end);
+		if(!rec->id || rec->id <= last ||
+				seg_log_rec_size(rec->len) > seg->size - seg->end)
+			break;
+
+		_seg_log_index(seg, rec->id);
+		last = rec->id;
+		seg->end += seg_log_rec_size(rec->len);
+	}
+	if(n > seg->nindex)
+		memset(&seg->index[seg->nindex], 0,
+				(n - seg->nindex) * sizeof(*seg->index));
+
+	atomic_init(&seg->len, seg->end);
+
+	return last;
+}
+
+static int _seg_log_base_cmp(const void *a, const void *b)
+{
+	uint64_t ba = *(const uint64_t *)a, bb = *(const uint64_t *)b;
+
+	return (ba > bb) - (ba < bb);
+}
+
+/*
+ * Opens (or creates) the log in the directory at path
+ *
+ * Fails with ENOTSUP if it holds segments from before IDs were 64-bit (named
+ * in 8 hex digits), which this can not read.
+ */
+int seg_log_open(struct seg_log *log, const char *path, size_t seg_size)
+{
+	struct seg_log_seg *seg;
+	struct dirent *ent;
+	uint64_t *bases = NULL, *more, last;
+	size_t i, n = 0, cap = 0;
+	DIR *dir;
+
+	log->seg_size = seg_size;
+	log->first = log->last = NULL;
+	log->last_id = 0;
+	pthread_mutex_init(&log->lock, NULL);
+
+	if(mkdir(path, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH) < 0 &&
+			errno != EEXIST)
+		return -1;
+	if((log->dirfd = open(path, O_RDONLY | O_DIRECTORY)) < 0)
+		return -1;
+
+	/* Segments are named after their first ID, in hex */
+	if(!(dir = opendir(path)))
+		return -1;
+	while((ent = readdir(dir))) {
+		uint64_t base;
+
+		if(strlen(ent->d_name) == 12 && !strcmp(ent->d_name + 8, ".log")) {
+			free(bases);
+			closedir(dir);
+			errno = ENOTSUP;
+			return -1;
+		}
+		if(strlen(ent->d_name) != SEG_LOG_NAME_LEN + 4 ||
+				strcmp(ent->d_name + SEG_LOG_NAME_LEN, ".log") ||
+				sscanf(ent->d_name, "%16" SCNx64, &base) != 1)
+			continue;
+
+		if(n == cap) {
+			cap = cap ? cap * 2 : 64;
+			if(!(more = realloc(bases, cap * sizeof(*bases)))) {
+				free(bases);
+				closedir(dir);
+				return -1;
+			}
+			bases = more;
+		}
+		bases[n++] = base;
+	}
+	closedir(dir);
+	qsort(bases, n, sizeof(*bases), _seg_log_base_cmp);
+
+	for(i = 0; i < n; i++) {
+		if(!(seg = _seg_log_seg(log, bases[i], 0, 0))) {
+			free(bases);
+			return -1;
+		}
+		if((last = _seg_log_recover(seg)))
+			log->last_id = last;
+
+		if(log->last) {
+			_seg_log_unmap_seg(log->last);
+			log->last->next = seg;
+		} else {
+			log->first = seg;
+		}
+		log->last = seg;
+	}
+	free(bases);
+
+	return log->dirfd;
+}
+
+void seg_log_close(struct seg_log *log)
+{
+	struct seg_log_seg *seg, *next;
+
+	for(seg = log->first; seg; seg = next) {
+		next = seg->next;
+		_seg_log_unmap_seg(seg);
+		free(seg);
+	}
+	log->first = log->last = NULL;
+
+	close(log->dirfd);
+	pthread_mutex_destroy(&log->lock);
+}
+
+/* Starts a new segment at id, once the last one is full */
+static int _seg_log_add(struct seg_log *log, uint64_t id)
+{
+	struct seg_log_seg *seg;
+
+	if(!(seg = _seg_log_seg(log, id, log->seg_size, O_CREAT | O_TRUNC)))
+		return -1;
+	atomic_init(&seg->len, 0);
+
+	/* Everything in the old segment is readable once it is not the last */
+	if(log->last)
+		atomic_store_explicit(&log->last->len, log->last->end,
+				memory_order_release);
+
+	pthread_mutex_lock(&log->lock);
+	if(log->last) {
+		log->last->next = seg;
+		if(!log->last->refs)
+			_seg_log_unmap_seg(log->last);
+	} else {
+		log->first = seg;
+	}
+	log->last = seg;
+	pthread_mutex_unlock(&log->lock);
+
+	return 0;
+}
+
+/* Appends a record, which readers see once it is committed */
+int seg_log_append(struct seg_log *log, uint64_t id, const void *data,
+		uint32_t len)
+{
+	struct seg_log_seg *seg = log->last;
+	struct seg_log_rec *rec;
+	size_t size = seg_log_rec_size(len);
+
+	if(size > log->seg_size || id <= log->last_id) {
+		errno = EINVAL;
+		return -1;
+	}
+	if(!seg || size > seg->size - seg->end) {
+		if(_seg_log_add(log, id) < 0)
+			return -1;
+		seg = log->last;
+	}
+
+	rec = (struct seg_log_rec *)(seg->data + seg->end);
+	memcpy(rec->data, data, len);
+	rec->len = len;
+	rec->pad = 0;
+	rec->id = id;
+	_seg_log_index(seg, id);
+	seg->end += size;
+	log->last_id = id;
+
+	return 0;
+}
+
+/* Lets readers see every record appended so far */
+void seg_log_commit(struct seg_log *log)
+{
+	if(log->last)
+		atomic_store_explicit(&log->last->len, log->last->end,
+				memory_order_release);
+}
+
+/* Finds the first ID still in the log, 0 if it is empty */
+uint64_t seg_log_first_id(struct seg_log *log)
+{
+	uint64_t id;
+
+	pthread_mutex_lock(&log->lock);
+	id = log->first ? log->first->base : 0;
+	pthread_mutex_unlock(&log->lock);
+
+	return id;
+}
+
+static inline unsigned long long _seg_log_seg_bytes(struct seg_log_seg *seg)
+{
+	return seg->size + _seg_log_index_ents(seg->size) * sizeof(*seg->index);
+}
+
+/* Totals the bytes of every segment and its index */
+unsigned long long seg_log_bytes(struct seg_log *log)
+{
+	struct seg_log_seg *seg;
+	unsigned long long bytes = 0;
+
+	pthread_mutex_lock(&log->lock);
+	for(seg = log->first; seg; seg = seg->next)
+		bytes += _seg_log_seg_bytes(seg);
+	pthread_mutex_unlock(&log->lock);
+
+	return bytes;
+}
+
+/* Finds the first ID of the oldest segments to keep within bytes */
+uint64_t seg_log_cutoff(struct seg_log *log, unsigned long long bytes)
+{
+	struct seg_log_seg *seg;
+	unsigned long long total = 0;
+	uint64_t id;
+
+	pthread_mutex_lock(&log->lock);
+	for(seg = log->first; seg; seg = seg->next)
+		total += _seg_log_seg_bytes(seg);
+	for(seg = log->first; seg && seg != log->last && total > bytes;
+			seg = seg->next)
+		total -= _seg_log_seg_bytes(seg);
+	id = seg ? seg->base : 0;
+	pthread_mutex_unlock(&log->lock);
+
+	return id;
+}
+
+static int _seg_log_unlink(struct seg_log *log, struct seg_log_seg *seg)
+{
+	char name[SEG_LOG_NAME_LEN + 5];
+	int ret = 0;
+
+	snprintf(name, sizeof(name), "%016" PRIx64 ".log", seg->base);
+	if(unlinkat(log->dirfd, name, 0) < 0)
+		ret = -1;
+	snprintf(name, sizeof(name), "%016" PRIx64 ".idx", seg->base);
+	if(unlinkat(log->dirfd, name, 0) < 0)
+		ret = -1;
+
+	return ret;
+}
+
+/*
+ * Deletes the segments only holding IDs before the given one
+ *
+ * The last segment is kept. A segment a cursor is still reading is deleted
+ * all the same, but stays mapped until that cursor next looks at it, when it
+ * skips to the oldest segment left; so a stalled reader holds on to one
+ * segment at most, and never keeps the log from being trimmed. Returns the
+ * number of segments deleted, or -1.
+ */
+int seg_log_trim(struct seg_log *log, uint64_t before)
+{
+	struct seg_log_seg *seg, *trimmed = NULL, **tail = &trimmed;
+	int n = 0, ret = 0;
+
+	pthread_mutex_lock(&log->lock);
+	while(log->first != log->last && log->first->next->base <= before) {
+		seg = log->first;
+		log->first = seg->next;
+		seg->next = NULL;
+		n++;
+
+		/* Cursors on it free it, once they let go */
+		if(seg->refs) {
+			atomic_store_explicit(&seg->trimmed, true,
+					memory_order_relaxed);
+			if(_seg_log_unlink(log, seg) < 0)
+				ret = -1;
+			continue;
+		}
+		*tail = seg;
+		tail = &seg->next;
+	}
+	pthread_mutex_unlock(&log->lock);
+
+	while((seg = trimmed)) {
+		trimmed = seg->next;
+
+		if(_seg_log_unlink(log, seg) < 0)
+			ret = -1;
+		_seg_log_unmap_seg(seg);
+		free(seg);
+	}
+
+	return ret < 0 ? ret : n;
+}
+
+/* Positions a cursor at the first record with an ID at or after id */
+void seg_log_seek(struct seg_log *log, struct seg_log_cursor *cur,
+		uint64_t id)
+{
+	const struct seg_log_rec *rec;
+	struct seg_log_seg *seg;
+	size_t len, lo, hi;
+
+	cur->log = log;
+	cur->off = 0;
+
+	pthread_mutex_lock(&log->lock);
+	for(seg = log->first; seg && seg->next && seg->next->base <= id;
+			seg = seg->next)
+		;
+	if(seg && _seg_log_ref(log, seg) < 0)
+		seg = NULL;
+	pthread_mutex_unlock(&log->lock);
+	if(!(cur->seg = seg))
+		return;
+
+	/*
+	 * Last index entry at or before id, ignoring any for records not yet
+	 * committed (which could be half written)
+	 */
+	len = atomic_load_explicit(&seg->len, memory_order_acquire);
+	lo = 0;
+	hi = (len + SEG_LOG_INDEX_EVERY - 1) / SEG_LOG_INDEX_EVERY;
+	if(hi > _seg_log_index_ents(seg->size))
+		hi = _seg_log_index_ents(seg->size);
+	while(lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		struct seg_log_ent ent = seg->index[mid];
+
+		if(ent.id && ent.off < len && ent.id <= id)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if(lo)
+		cur->off = seg->index[lo-1].off;
+
+	while((rec = seg_log_get(cur)) && rec->id < id)
+		seg_log_next(cur, rec);
+}
+
+/* Gets the record at a cursor, without copying it, or NULL if none yet */
+const struct seg_log_rec *seg_log_get(struct seg_log_cursor *cur)
+{
+	struct seg_log_seg *seg, *next;
+
+	while((seg = cur->seg)) {
+		if(cur->off < atomic_load_explicit(&seg->len, memory_order_acquire) &&
+				!atomic_load_explicit(&seg->trimmed, memory_order_relaxed))
+			return (const struct seg_log_rec *)(seg->data + cur->off);
+
+		/* Move on once a segment is done, checking again for a last record */
+		pthread_mutex_lock(&cur->log->lock);
+		next = seg->next;
+		if(atomic_load_explicit(&seg->trimmed, memory_order_relaxed)) {
+			/* Its records are gone, so on to the oldest ones left */
+			next = cur->log->first;
+			if(next && _seg_log_ref(cur->log, next) < 0)
+				next = NULL;
+			_seg_log_unref(cur->log, seg);
+			cur->seg = next;
+			cur->off = 0;
+		} else if(next && cur->off >= atomic_load_explicit(&seg->len,
+					memory_order_relaxed)) {
+			if(_seg_log_ref(cur->log, next) < 0)
+				next = NULL;
+			_seg_log_unref(cur->log, seg);
+			cur->seg = next;
+			cur->off = 0;
+		}
+		pthread_mutex_unlock(&cur->log->lock);
+
+		if(!next)
+			return NULL;
+	}
+
+	return NULL;
+}
+
+void seg_log_cursor_close(struct seg_log_cursor *cur)
+{
+	if(!cur->seg)
+		return;
+
+	pthread_mutex_lock(&cur->log->lock);
+	_seg_log_unref(cur->log, cur->seg);
+	pthread_mutex_unlock(&cur->log->lock);
+	cur->seg = NULL;
+}
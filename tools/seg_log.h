@@ -0,0 +1,137 @@
+/*
+ * Segmented Log Library
+ *
+ * Append-only store of records with increasing 64-bit IDs, kept in a
+ * directory of fixed-size segment files named after their first ID. Each
+ * segment is mapped into memory, along with a sparse index of where every
+ * SEG_LOG_INDEX_EVERY bytes of it starts, so reads come straight from the
+ * mapping. Old data is dropped a whole segment at a time.
+ *
+ * One thread appends and commits; any thread may read with a cursor or trim.
+ *
+ *
+ * Author: agent <agent@local>
+ *
+ * Copyright (C) 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef SEG_LOG_H
+#define SEG_LOG_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+/* Bytes of records between sparse index entries */
+#define SEG_LOG_INDEX_EVERY	4096
+
+/* Record header, followed by its data padded to 8 bytes */
+struct seg_log_rec
+{
+	uint64_t id;
+	uint32_t len;
+	uint32_t pad;
+	char data[];
+};
+
+/* Sparse index entry, for the first record at or after a multiple of EVERY */
+struct seg_log_ent
+{
+	uint64_t id;
+	uint64_t off;
+};
+
+struct seg_log_seg
+{
+	uint64_t base;
+	/* Bytes of the segment file, which may be from an older seg_size */
+	size_t size;
+	char *data;
+	struct seg_log_ent *index;
+	/* Bytes of records readers may see */
+	atomic_size_t len;
+	/* Bytes of records and index entries written, by the appending thread */
+	size_t end;
+	size_t nindex;
+	/* Cursors on this segment */
+	int refs;
+	/* Deleted while cursors were on it, which drop it when they next look */
+	atomic_bool trimmed;
+	struct seg_log_seg *next;
+};
+
+struct seg_log
+{
+	int dirfd;
+	size_t seg_size;
+	/* Guards the segment list and references to segments */
+	pthread_mutex_t lock;
+	struct seg_log_seg *first, *last;
+	/* Last ID appended, 0 if none */
+	uint64_t last_id;
+};
+
+struct seg_log_cursor
+{
+	struct seg_log *log;
+	struct seg_log_seg *seg;
+	size_t off;
+};
+
+int seg_log_open(struct seg_log *log, const char *path, size_t seg_size);
+void seg_log_close(struct seg_log *log);
+
+int seg_log_append(struct seg_log *log, uint64_t id, const void *data,
+		uint32_t len);
+void seg_log_commit(struct seg_log *log);
+
+uint64_t seg_log_first_id(struct seg_log *log);
+unsigned long long seg_log_bytes(struct seg_log *log);
+uint64_t seg_log_cutoff(struct seg_log *log, unsigned long long bytes);
+int seg_log_trim(struct seg_log *log, uint64_t before);
+
+void seg_log_seek(struct seg_log *log, struct seg_log_cursor *cur,
+		uint64_t id);
+const struct seg_log_rec *seg_log_get(struct seg_log_cursor *cur);
+void seg_log_cursor_close(struct seg_log_cursor *cur);
+
+static inline size_t seg_log_rec_size(uint32_t len)
+{
+	return sizeof(struct seg_log_rec) + ((len + 7) & ~7UL);
+}
+
+/* Moves a cursor past the record seg_log_get returned */
+static inline void seg_log_next(struct seg_log_cursor *cur,
+		const struct seg_log_rec *rec)
+{
+	cur->off += seg_log_rec_size(rec->len);
+}
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif /* SEG_LOG_H */
@@ -0,0 +1,221 @@
+/*
+ * Message store benchmark
+ *
+ * Stores the same messages in LevelDB, as isoblued does by default, and in a
+ * segmented log, then compares how fast each takes them in and replays them
+ * (encoding each for a client as isoblued does: decoded from LevelDB, and
+ * straight from the mapping for the log), and how much disk each uses per
+ * message.
+ *
+ *
+ * Author: agent <agent@local>
+ *
+ * Copyright (C) 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <leveldb/c.h>
+
+#include "hex.h"
+#include "mesg_rec.h"
+#include "pgn_index.h"
+#include "seg_log.h"
+#include "bench.h"
+
+#define DB_PATH	"seg_log_bench_db"
+#define LOG_PATH	"seg_log_bench_log"
+
+#define SEGMENT_DEF	64
+
+static void report(const char *name, uint32_t nrecs, double t_in,
+		double t_out, unsigned long long n_out, unsigned long long bytes)
+{
+	printf("%-8s ingest %9.0f messages/s, replay %9.0f messages/s, "
+			"%6.1f bytes/message on disk\n", name, nrecs / t_in,
+			n_out / t_out, (double)bytes / nrecs);
+}
+
+static void bench_leveldb(uint32_t nrecs)
+{
+	leveldb_t *db;
+	leveldb_options_t *options;
+	leveldb_writeoptions_t *woptions;
+	leveldb_readoptions_t *roptions;
+	leveldb_writebatch_t *wb;
+	leveldb_iterator_t *iter;
+	struct pgn_index_batch batch;
+	struct mesg_rec r;
+	unsigned long long n = 0, sum = 0;
+	char *err = NULL;
+	char key[PGN_INDEX_ID_LEN], out[HEX_MESG_MAX];
+	double start, t_in, t_out;
+	uint32_t id;
+	size_t len;
+
+	options = leveldb_options_create();
+	leveldb_options_set_create_if_missing(options, 1);
+	leveldb_destroy_db(options, DB_PATH, &err);
+	bench_check(err, "leveldb_destroy_db");
+	db = leveldb_open(options, DB_PATH, &err);
+	bench_check(err, "leveldb_open");
+	woptions = leveldb_writeoptions_create();
+	roptions = leveldb_readoptions_create();
+	leveldb_readoptions_set_fill_cache(roptions, 0);
+	wb = leveldb_writebatch_create();
+	if(pgn_index_batch_create(&batch, 4096) < 0) {
+		perror("pgn_index_batch_create");
+		exit(EXIT_FAILURE);
+	}
+
+	srand(1);
+	start = bench_now();
+	for(id = 1; id <= nrecs; id++) {
+		char val[HEX_MESG_MAX];
+
+		bench_mesg(&r, id, 0xFE00 + rand() % 64);
+		len = hex_mesg(val, 'M', &r) - val;
+		pgn_index_put_id(key, id);
+		leveldb_writebatch_put(wb, key, sizeof(key), val + 1, len - 1);
+		pgn_index_batch_add(&batch, wb, r.pgn, id);
+		if(id % BENCH_COMMIT_COUNT == 0 || id == nrecs) {
+			pgn_index_batch_flush(&batch, wb);
+			leveldb_write(db, woptions, wb, &err);
+			bench_check(err, "leveldb_write");
+			leveldb_writebatch_clear(wb);
+		}
+	}
+	t_in = bench_now() - start;
+
+	pgn_index_put_id(key, 1);
+	start = bench_now();
+	iter = leveldb_create_iterator(db, roptions);
+	for(leveldb_iter_seek(iter, key, sizeof(key));
+			leveldb_iter_valid(iter); leveldb_iter_next(iter)) {
+		const char *val;
+
+		leveldb_iter_key(iter, &len);
+		if(len != sizeof(key))
+			break;
+		val = leveldb_iter_value(iter, &len);
+		if(parse_mesg(val, len, &r)) {
+			sum += hex_mesg(out, 'O', &r) - out;
+			n++;
+		}
+	}
+	leveldb_iter_destroy(iter);
+	t_out = bench_now() - start;
+
+	leveldb_close(db);
+	report("leveldb", nrecs, t_in, t_out, n, bench_du(DB_PATH, 0));
+	leveldb_destroy_db(options, DB_PATH, &err);
+
+	pgn_index_batch_free(&batch);
+	leveldb_writebatch_destroy(wb);
+	leveldb_readoptions_destroy(roptions);
+	leveldb_writeoptions_destroy(woptions);
+	leveldb_options_destroy(options);
+
+	if(n != nrecs || !sum) {
+		fprintf(stderr, "leveldb replayed %llu of %u messages\n", n, nrecs);
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void bench_log(uint32_t nrecs, size_t seg_size)
+{
+	struct seg_log log;
+	struct seg_log_cursor cur;
+	const struct seg_log_rec *rec;
+	struct mesg_rec r;
+	unsigned long long n = 0, sum = 0;
+	double start, t_in, t_out;
+	char out[HEX_MESG_MAX];
+	uint32_t id;
+
+	bench_du(LOG_PATH, 1);
+	if(seg_log_open(&log, LOG_PATH, seg_size) < 0) {
+		perror("seg_log_open");
+		exit(EXIT_FAILURE);
+	}
+
+	srand(1);
+	start = bench_now();
+	for(id = 1; id <= nrecs; id++) {
+		bench_mesg(&r, id, 0xFE00 + rand() % 64);
+		if(seg_log_append(&log, id, &r, sizeof(r)) < 0) {
+			perror("seg_log_append");
+			exit(EXIT_FAILURE);
+		}
+		if(id % BENCH_COMMIT_COUNT == 0 || id == nrecs)
+			seg_log_commit(&log);
+	}
+	t_in = bench_now() - start;
+
+	start = bench_now();
+	/* Encoded where they are mapped, as isoblued replays them */
+	for(seg_log_seek(&log, &cur, 1); (rec = seg_log_get(&cur));
+			seg_log_next(&cur, rec)) {
+		sum += hex_mesg(out, 'O', (const struct mesg_rec *)rec->data) - out;
+		n++;
+	}
+	seg_log_cursor_close(&cur);
+	t_out = bench_now() - start;
+
+	seg_log_close(&log);
+	report("log", nrecs, t_in, t_out, n, bench_du(LOG_PATH, 1));
+
+	if(n != nrecs || !sum) {
+		fprintf(stderr, "log replayed %llu of %u messages\n", n, nrecs);
+		exit(EXIT_FAILURE);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	uint32_t nrecs;
+	size_t seg_mb;
+
+	if(argc > 3) {
+		fprintf(stderr, "usage: seg_log_bench [RECORDS [SEGMENT_MB]]\n");
+		return EXIT_FAILURE;
+	}
+	nrecs = argc > 1 ? strtoul(argv[1], NULL, 0) : BENCH_RECS_DEF;
+	seg_mb = argc > 2 ? strtoul(argv[2], NULL, 0) : SEGMENT_DEF;
+	if(nrecs < 1 || seg_mb < 1) {
+		fprintf(stderr, "RECORDS and SEGMENT_MB must be positive\n");
+		return EXIT_FAILURE;
+	}
+
+	printf("storing %u messages, %zu MB log segments\n", nrecs, seg_mb);
+	bench_leveldb(nrecs);
+	bench_log(nrecs, seg_mb * 1048576);
+
+	return EXIT_SUCCESS;
+}
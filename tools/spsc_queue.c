@@ -0,0 +1,123 @@
+/*
+ * Single Producer Single Consumer Queue Library
+ *
+ *
+ * Author: agent <agent@local>
+ *
+ * Copyright (C) 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "spsc_queue.h"
+
+int spsc_queue_create(struct spsc_queue *queue, unsigned long order,
+		size_t elem_size)
+{
+	queue->count_elems = 1UL << order;
+	queue->elem_size = elem_size;
+	atomic_init(&queue->head, 0);
+	atomic_init(&queue->tail, 0);
+
+	/* Cache line aligned, so elements are as aligned as their type wants */
+	queue->address = aligned_alloc(64, queue->count_elems * elem_size);
+	if(!queue->address)
+		return -1;
+	memset(queue->address, 0, queue->count_elems * elem_size);
+
+	return 0;
+}
+
+void spsc_queue_free(struct spsc_queue *queue)
+{
+	free(queue->address);
+}
+
+static inline unsigned long _queue_mod(struct spsc_queue *queue,
+		unsigned long count)
+{
+	return count & (queue->count_elems - 1);
+}
+
+unsigned long spsc_queue_free_elems(struct spsc_queue *queue)
+{
+	return queue->count_elems - spsc_queue_depth(queue);
+}
+
+/* Copies in as many elements as fit, returns how many that was */
+unsigned long spsc_queue_push(struct spsc_queue *queue, const void *elems,
+		unsigned long count_elems)
+{
+	unsigned long tail, room, first;
+
+	tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+	room = queue->count_elems - (tail -
+			atomic_load_explicit(&queue->head, memory_order_acquire));
+	if(count_elems > room)
+		count_elems = room;
+
+	/* Copy in up to two pieces, when wrapping past the end */
+	first = queue->count_elems - _queue_mod(queue, tail);
+	if(first > count_elems)
+		first = count_elems;
+	memcpy(queue->address + _queue_mod(queue, tail) * queue->elem_size,
+			elems, first * queue->elem_size);
+	memcpy(queue->address, (const char *)elems + first * queue->elem_size,
+			(count_elems - first) * queue->elem_size);
+
+	atomic_store_explicit(&queue->tail, tail + count_elems,
+			memory_order_release);
+
+	return count_elems;
+}
+
+/* Finds elements ready to consume, which are contiguous in memory */
+unsigned long spsc_queue_peek(struct spsc_queue *queue, void **elems)
+{
+	unsigned long head, count, first;
+
+	head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+	count = atomic_load_explicit(&queue->tail, memory_order_acquire) - head;
+
+	first = queue->count_elems - _queue_mod(queue, head);
+	if(count > first)
+		count = first;
+
+	*elems = queue->address + _queue_mod(queue, head) * queue->elem_size;
+
+	return count;
+}
+
+void spsc_queue_pop(struct spsc_queue *queue, unsigned long count_elems)
+{
+	unsigned long head;
+
+	head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+	atomic_store_explicit(&queue->head, head + count_elems,
+			memory_order_release);
+}
+
+unsigned long spsc_queue_depth(struct spsc_queue *queue)
+{
+	return atomic_load_explicit(&queue->tail, memory_order_acquire) -
+		atomic_load_explicit(&queue->head, memory_order_acquire);
+}
@@ -0,0 +1,70 @@
+/*
+ * Single Producer Single Consumer Queue Library
+ *
+ * Lock-free queue of fixed size elements, for handing data between exactly
+ * one producer thread and one consumer thread.
+ *
+ *
+ * Author: agent <agent@local>
+ *
+ * Copyright (C) 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdatomic.h>
+
+struct spsc_queue
+{
+	char *address;
+	size_t elem_size;
+	unsigned long count_elems;
+
+	/* Free running counters, only ever advanced by one side each */
+	atomic_ulong head;
+	char pad[64];
+	atomic_ulong tail;
+};
+
+int spsc_queue_create(struct spsc_queue *queue, unsigned long order,
+		size_t elem_size);
+void spsc_queue_free(struct spsc_queue *queue);
+/* Producer side */
+unsigned long spsc_queue_push(struct spsc_queue *queue, const void *elems,
+		unsigned long count_elems);
+unsigned long spsc_queue_free_elems(struct spsc_queue *queue);
+/* Consumer side */
+unsigned long spsc_queue_peek(struct spsc_queue *queue, void **elems);
+void spsc_queue_pop(struct spsc_queue *queue, unsigned long count_elems);
+/* Either side */
+unsigned long spsc_queue_depth(struct spsc_queue *queue);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif /* SPSC_QUEUE_H */
@@ -0,0 +1,228 @@
+/*
+ * Time Index Library
+ *
+ *
+ * Author: agent <agent@local>
+ *
+ * Copyright (C) 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "time_index.h"
+
+static int _time_index_grow(struct time_index *index)
+{
+	struct time_index_ent *ents;
+	size_t cap;
+
+	cap = index->cap_ents ? index->cap_ents * 2 : 1024;
+	ents = realloc(index->ents, cap * sizeof(*ents));
+	if(!ents)
+		return -1;
+
+	index->ents = ents;
+	index->cap_ents = cap;
+
+	return 0;
+}
+
+/* Opens (or creates) the index, forgetting entries for IDs never stored */
+int time_index_open(struct time_index *index, const char *path,
+		uint32_t interval, uint64_t next_id)
+{
+	struct time_index_ent ent;
+	size_t i;
+
+	index->interval = interval ? interval : 1;
+	index->last_sec = 0;
+	index->ents = NULL;
+	index->count_ents = index->cap_ents = 0;
+	pthread_mutex_init(&index->lock, NULL);
+
+	if(!(index->path = strdup(path)))
+		return -1;
+	index->fd = open(path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+	if(index->fd < 0)
+		return index->fd;
+
+	/* Keep entries up to the first one out of order, or past the end */
+	while(read(index->fd, &ent, sizeof(ent)) == sizeof(ent)) {
+		i = index->count_ents;
+		if(ent.id >= next_id || (i && (ent.sec <= index->ents[i-1].sec ||
+						ent.id <= index->ents[i-1].id)))
+			break;
+
+		if(i == index->cap_ents && _time_index_grow(index) < 0)
+			return -1;
+		index->ents[index->count_ents++] = ent;
+		index->last_sec = ent.sec;
+	}
+
+	/* Appends go after the entries kept */
+	if(ftruncate(index->fd, index->count_ents * sizeof(ent)) < 0 ||
+			lseek(index->fd, 0, SEEK_END) < 0)
+		return -1;
+
+	return index->fd;
+}
+
+void time_index_close(struct time_index *index)
+{
+	close(index->fd);
+	free(index->path);
+	free(index->ents);
+	pthread_mutex_destroy(&index->lock);
+}
+
+/* Notes a stored message, adding an entry when interval has passed */
+int time_index_note(struct time_index *index, uint32_t sec, uint64_t id)
+{
+	struct time_index_ent ent;
+	int ret = 1;
+
+	/* Only the appending thread adds entries, so no lock to look */
+	if(index->last_sec && (sec - index->last_sec < index->interval ||
+				sec <= index->last_sec))
+		return 0;
+
+	ent.sec = sec;
+	ent.pad = 0;
+	ent.id = id;
+
+	pthread_mutex_lock(&index->lock);
+	if(index->count_ents == index->cap_ents && _time_index_grow(index) < 0) {
+		pthread_mutex_unlock(&index->lock);
+		return -1;
+	}
+	index->ents[index->count_ents++] = ent;
+	index->last_sec = sec;
+	if(write(index->fd, &ent, sizeof(ent)) != sizeof(ent))
+		ret = -1;
+	pthread_mutex_unlock(&index->lock);
+
+	return ret;
+}
+
+/* Finds how many entries are at or before sec */
+static size_t _time_index_upper(struct time_index *index, uint32_t sec)
+{
+	size_t lo = 0, hi = index->count_ents;
+
+	while(lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if(index->ents[mid].sec <= sec)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/* Finds an ID no later than the first message received at or after sec */
+uint64_t time_index_start(struct time_index *index, uint32_t sec)
+{
+	uint64_t id;
+	size_t i;
+
+	pthread_mutex_lock(&index->lock);
+	i = _time_index_upper(index, sec);
+	id = i ? index->ents[i-1].id : 0;
+	pthread_mutex_unlock(&index->lock);
+
+	return id;
+}
+
+/* Finds an ID after every message received at or before sec */
+uint64_t time_index_stop(struct time_index *index, uint32_t sec,
+		uint64_t next_id)
+{
+	uint64_t id;
+	size_t i;
+
+	pthread_mutex_lock(&index->lock);
+	i = _time_index_upper(index, sec);
+	id = i < index->count_ents ? index->ents[i].id : next_id;
+	pthread_mutex_unlock(&index->lock);
+
+	return id;
+}
+
+/* Writes entries to a new file, then puts it in place of the index's */
+static int _time_index_replace(struct time_index *index,
+		const struct time_index_ent *ents, size_t count)
+{
+	size_t len = strlen(index->path) + sizeof(".new");
+	ssize_t size = count * sizeof(*ents);
+	char tmp[len];
+	int fd;
+
+	snprintf(tmp, len, "%s.new", index->path);
+	fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+	if(fd < 0)
+		return -1;
+	if(write(fd, ents, size) != size || fsync(fd) < 0 ||
+			rename(tmp, index->path) < 0) {
+		close(fd);
+		unlink(tmp);
+		return -1;
+	}
+
+	close(index->fd);
+	index->fd = fd;
+
+	return 0;
+}
+
+/*
+ * Forgets the entries for IDs before first_id, once they are deleted
+ *
+ * Returns how many entries were dropped, or -1 on error.
+ */
+int time_index_trim(struct time_index *index, uint64_t first_id)
+{
+	size_t i;
+	int ret;
+
+	pthread_mutex_lock(&index->lock);
+	for(i = 0; i < index->count_ents && index->ents[i].id < first_id; i++)
+		;
+	ret = i ? _time_index_replace(index, index->ents + i,
+			index->count_ents - i) : 0;
+	if(i && !ret) {
+		index->count_ents -= i;
+		memmove(index->ents, index->ents + i,
+				index->count_ents * sizeof(*index->ents));
+		ret = i;
+	}
+	pthread_mutex_unlock(&index->lock);
+
+	return ret;
+}
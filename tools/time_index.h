@@ -0,0 +1,79 @@
+/*
+ * Time Index Library
+ *
+ * Sparse, persistent map from receive time to the first message ID stored
+ * at (or after) that time. Entries are appended in time order, so finding
+ * where a time range starts is a binary search.
+ *
+ *
+ * Author: agent <agent@local>
+ *
+ * Copyright (C) 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef TIME_INDEX_H
+#define TIME_INDEX_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+struct time_index_ent
+{
+	uint32_t sec;
+	uint32_t pad;
+	uint64_t id;
+};
+
+struct time_index
+{
+	int fd;
+	char *path;
+	/* Seconds between entries */
+	uint32_t interval;
+	/* Second of the last entry added, only used by the appending thread */
+	uint32_t last_sec;
+
+	/* Appended to by one thread while others search and trim */
+	pthread_mutex_t lock;
+	struct time_index_ent *ents;
+	size_t count_ents;
+	size_t cap_ents;
+};
+
+int time_index_open(struct time_index *index, const char *path,
+		uint32_t interval, uint64_t next_id);
+void time_index_close(struct time_index *index);
+int time_index_note(struct time_index *index, uint32_t sec, uint64_t id);
+uint64_t time_index_start(struct time_index *index, uint32_t sec);
+uint64_t time_index_stop(struct time_index *index, uint32_t sec,
+		uint64_t next_id);
+int time_index_trim(struct time_index *index, uint64_t first_id);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif /* TIME_INDEX_H */